@@ -0,0 +1,59 @@
+// Headless rescoring of every local solution, no SDL/OpenGL.
+// Usage: batch [inputs dir] [solutions dir] [threads]
+// Writes local_scores.txt and batch_report.txt to the current directory.
+
+#include <iostream>
+#include <cmath>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <array>
+#include <thread>
+#include <cassert>
+#include <tuple>
+#include <chrono>
+#include <iomanip>
+
+using namespace std;
+typedef std::chrono::high_resolution_clock Time;
+typedef std::chrono::milliseconds chrono_ms;
+
+#define sqr(x) (x)*(x)
+using ll = long long;
+using Color = array<int, 4>;
+
+#include "painter.h"
+#include "io.h"
+
+int main(int argc, char** argv) {
+    string inputsPath = argc > 1 ? string(argv[1]) + "/" : "../inputs/";
+    string solutionsPath = argc > 2 ? string(argv[2]) + "/" : "../solutions/";
+    int threads = argc > 3 ? atoi(argv[3]) : 0;
+
+    auto start = Time::now();
+    auto scores = scoreLocal(inputsPath, solutionsPath, threads);
+    double wallMs = chrono::duration<double, milli>(Time::now() - start).count();
+
+    unordered_map<int, int> local;
+    ofstream report("batch_report.txt");
+    report << "test score instructions read_ms replay_ms\n";
+    ll total = 0;
+    int bad = 0, missing = 0;
+    for (const auto& r : scores) {
+        report << r.testId << " " << r.score << " " << r.instructions << " "
+               << fixed << setprecision(1) << r.readMs << " " << r.replayMs << "\n";
+        if (r.score == -1) {
+            missing++;
+            continue;
+        }
+        if (r.score == -100) bad++;
+        else total += r.score;
+        local[r.testId] = r.score;
+    }
+    report.close();
+    writeLocalScores(local);
+
+    cout << scores.size() << " tests, " << missing << " without solution, " << bad << " invalid\n";
+    cout << "total score " << total << ", " << fixed << setprecision(0) << wallMs << " ms\n";
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// 4 bytes per pixel, r g b a.
+using Pixel = array<uint8_t, 4>;
+
+inline Pixel toPixel(const Color& c) {
+    Pixel p;
+    for (int q = 0; q < 4; q++)
+        p[q] = (uint8_t)min(255, max(0, c[q]));
+    return p;
+}
+
+inline Color toColor(const Pixel& p) {
+    return Color{p[0], p[1], p[2], p[3]};
+}
+
+// Row-major RGBA image in one 32-byte aligned buffer. canvas[i][j] is the pixel
+// at row i, column j. Copies are deep.
+struct Canvas {
+    int n = 0, m = 0;
+    Pixel* data = nullptr;
+    shared_ptr<void> storage;
+
+    Canvas() {}
+    Canvas(int n, int m, Pixel fill = Pixel{0, 0, 0, 0}) : n(n), m(m) {
+        allocate();
+        for (int i = 0; i < n; i++)
+            fillRow((*this)[i], m, fill);
+    }
+    Canvas(const Canvas& o) : n(o.n), m(o.m) {
+        allocate();
+        if (o.data) memcpy(data, o.data, bytes());
+    }
+    Canvas(Canvas&& o) noexcept : n(o.n), m(o.m), data(o.data), storage(std::move(o.storage)) {
+        o.n = o.m = 0;
+        o.data = nullptr;
+    }
+    Canvas& operator=(const Canvas& o) {
+        if (this != &o) *this = Canvas(o);
+        return *this;
+    }
+    Canvas& operator=(Canvas&& o) noexcept {
+        n = o.n;
+        m = o.m;
+        data = o.data;
+        storage = std::move(o.storage);
+        o.n = o.m = 0;
+        o.data = nullptr;
+        return *this;
+    }
+
+    // Wraps n x m pixels owned by someone else (e.g. a file mapping). keepAlive
+    // is held for as long as the view or its moves live; copies are owned.
+    static Canvas view(int n, int m, Pixel* data, shared_ptr<void> keepAlive) {
+        Canvas res;
+        res.n = n;
+        res.m = m;
+        res.data = data;
+        res.storage = std::move(keepAlive);
+        return res;
+    }
+
+    Pixel* operator[](int i) { return data + size_t(i) * m; }
+    const Pixel* operator[](int i) const { return data + size_t(i) * m; }
+    size_t bytes() const { return size_t(n) * m * sizeof(Pixel); }
+
+    // rotated[j][n - 1 - i] = (*this)[i][j]
+    Canvas rotatedClockwise() const {
+        Canvas res(m, n);
+        for (int i = 0; i < n; i++)
+            for (int j = 0; j < m; j++)
+                res[j][n - 1 - i] = (*this)[i][j];
+        return res;
+    }
+
+    // transposed[j][i] = (*this)[i][j]
+    Canvas transposed() const {
+        Canvas res(m, n);
+        for (int i = 0; i < n; i++)
+            for (int j = 0; j < m; j++)
+                res[j][i] = (*this)[i][j];
+        return res;
+    }
+
+    static void fillRow(Pixel* p, int len, Pixel c);
+
+  private:
+    void allocate() {
+        size_t sz = max<size_t>(32, (bytes() + 31) / 32 * 32);
+#ifdef _WIN32
+        storage = shared_ptr<void>(_aligned_malloc(sz, 32), _aligned_free);
+#else
+        storage = shared_ptr<void>(aligned_alloc(32, sz), free);
+#endif
+        data = (Pixel*)storage.get();
+    }
+};
+
+inline void Canvas::fillRow(Pixel* p, int len, Pixel c) {
+    uint32_t v;
+    memcpy(&v, c.data(), 4);
+#if defined(__AVX2__)
+    __m256i x = _mm256_set1_epi32((int)v);
+    for (; len >= 8; len -= 8, p += 8)
+        _mm256_storeu_si256((__m256i*)p, x);
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i x = _mm_set1_epi32((int)v);
+    for (; len >= 4; len -= 4, p += 4)
+        _mm_storeu_si128((__m128i*)p, x);
+#endif
+    for (; len > 0; len--, p++)
+        memcpy(p, &v, 4);
+}
+
+inline void fillRect(Canvas& cv, int r1, int c1, int r2, int c2, Pixel c) {
+    for (int i = r1; i < r2; i++)
+        Canvas::fillRow(cv[i] + c1, c2 - c1, c);
+}
+
+inline void swapRow(Pixel* a, Pixel* b, int len) {
+#if defined(__AVX2__)
+    for (; len >= 8; len -= 8, a += 8, b += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)a);
+        __m256i y = _mm256_loadu_si256((const __m256i*)b);
+        _mm256_storeu_si256((__m256i*)a, y);
+        _mm256_storeu_si256((__m256i*)b, x);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; len >= 4; len -= 4, a += 4, b += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)a);
+        __m128i y = _mm_loadu_si128((const __m128i*)b);
+        _mm_storeu_si128((__m128i*)a, y);
+        _mm_storeu_si128((__m128i*)b, x);
+    }
+#endif
+    for (; len > 0; len--, a++, b++)
+        swap(*a, *b);
+}
+
+// Swaps the h x w rectangles with top-left corners (r1, c1) and (r2, c2).
+inline void swapRect(Canvas& cv, int r1, int c1, int r2, int c2, int h, int w) {
+    for (int i = 0; i < h; i++)
+        swapRow(cv[r1 + i] + c1, cv[r2 + i] + c2, w);
+}
+
+#if defined(__AVX2__)
+// squared distances of 8 pixel pairs, in pixel order 0 1 4 5 2 3 6 7
+inline __m256i distSq8(__m256i va, __m256i vb) {
+    __m256i d0 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(va)),
+                                  _mm256_cvtepu8_epi16(_mm256_castsi256_si128(vb)));
+    __m256i d1 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1)),
+                                  _mm256_cvtepu8_epi16(_mm256_extracti128_si256(vb, 1)));
+    return _mm256_hadd_epi32(_mm256_madd_epi16(d0, d0), _mm256_madd_epi16(d1, d1));
+}
+
+// sum over 8 pixels of sqrt(sum_q (a_q - b_q)^2), as 2 x 4 doubles
+inline void distAcc8(__m256i va, __m256i vb, __m256d& acc0, __m256d& acc1) {
+    __m256i h = distSq8(va, vb);
+    acc0 = _mm256_add_pd(acc0, _mm256_sqrt_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(h))));
+    acc1 = _mm256_add_pd(acc1, _mm256_sqrt_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(h, 1))));
+}
+
+inline double hsum(__m256d a) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+// squared distances of 4 pixel pairs, in pixel order
+inline __m128i distSq4(__m128i va, __m128i vb) {
+    __m128i z = _mm_setzero_si128();
+    __m128i d0 = _mm_sub_epi16(_mm_unpacklo_epi8(va, z), _mm_unpacklo_epi8(vb, z));
+    __m128i d1 = _mm_sub_epi16(_mm_unpackhi_epi8(va, z), _mm_unpackhi_epi8(vb, z));
+    __m128 s0 = _mm_castsi128_ps(_mm_madd_epi16(d0, d0));
+    __m128 s1 = _mm_castsi128_ps(_mm_madd_epi16(d1, d1));
+    return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(s0, s1, _MM_SHUFFLE(2, 0, 2, 0))),
+                         _mm_castps_si128(_mm_shuffle_ps(s0, s1, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// sum over 4 pixels of sqrt(sum_q (a_q - b_q)^2), as 2 x 2 doubles
+inline void distAcc4(__m128i va, __m128i vb, __m128d& acc0, __m128d& acc1) {
+    __m128i h = distSq4(va, vb);
+    acc0 = _mm_add_pd(acc0, _mm_sqrt_pd(_mm_cvtepi32_pd(h)));
+    acc1 = _mm_add_pd(acc1, _mm_sqrt_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2)))));
+}
+
+inline double hsum(__m128d a) {
+    return _mm_cvtsd_f64(_mm_add_sd(a, _mm_unpackhi_pd(a, a)));
+}
+#endif
+
+inline double pixelDistF(const Pixel& a, const Pixel& b) {
+    int d = 0;
+    for (int q = 0; q < 4; q++)
+        d += sqr(int(a[q]) - int(b[q]));
+    return sqrt(double(d));
+}
+
+// Sum of euclidean distances between a[0..len) and b[0..len).
+inline double distSum(const Pixel* a, const Pixel* b, int len) {
+    double res = 0;
+#if defined(__AVX2__)
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    for (; len >= 8; len -= 8, a += 8, b += 8)
+        distAcc8(_mm256_loadu_si256((const __m256i*)a), _mm256_loadu_si256((const __m256i*)b), acc0, acc1);
+    res = hsum(_mm256_add_pd(acc0, acc1));
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    for (; len >= 4; len -= 4, a += 4, b += 4)
+        distAcc4(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b), acc0, acc1);
+    res = hsum(_mm_add_pd(acc0, acc1));
+#endif
+    for (; len > 0; len--, a++, b++)
+        res += pixelDistF(*a, *b);
+    return res;
+}
+
+// Sum of euclidean distances between a[0..len) and a single color.
+inline double distSum(const Pixel* a, int len, Pixel c) {
+    double res = 0;
+    uint32_t v;
+    memcpy(&v, c.data(), 4);
+#if defined(__AVX2__)
+    __m256i vc = _mm256_set1_epi32((int)v);
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    for (; len >= 8; len -= 8, a += 8)
+        distAcc8(_mm256_loadu_si256((const __m256i*)a), vc, acc0, acc1);
+    res = hsum(_mm256_add_pd(acc0, acc1));
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i vc = _mm_set1_epi32((int)v);
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    for (; len >= 4; len -= 4, a += 4)
+        distAcc4(_mm_loadu_si128((const __m128i*)a), vc, acc0, acc1);
+    res = hsum(_mm_add_pd(acc0, acc1));
+#endif
+    for (; len > 0; len--, a++)
+        res += pixelDistF(*a, c);
+    return res;
+}
+
+// Sum of w[i] * ||a[i] - c|| over a[0..len).
+inline double distSum(const Pixel* a, const int* w, int len, Pixel c) {
+    double res = 0;
+    uint32_t v;
+    memcpy(&v, c.data(), 4);
+#if defined(__AVX2__)
+    __m256i vc = _mm256_set1_epi32((int)v);
+    __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    for (; len >= 8; len -= 8, a += 8, w += 8) {
+        __m256i h = distSq8(_mm256_loadu_si256((const __m256i*)a), vc);
+        __m256i vw = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)w), order);
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_sqrt_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(h))),
+                                                 _mm256_cvtepi32_pd(_mm256_castsi256_si128(vw))));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_sqrt_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(h, 1))),
+                                                 _mm256_cvtepi32_pd(_mm256_extracti128_si256(vw, 1))));
+    }
+    res = hsum(_mm256_add_pd(acc0, acc1));
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i vc = _mm_set1_epi32((int)v);
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    for (; len >= 4; len -= 4, a += 4, w += 4) {
+        __m128i h = distSq4(_mm_loadu_si128((const __m128i*)a), vc);
+        __m128i vw = _mm_loadu_si128((const __m128i*)w);
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_sqrt_pd(_mm_cvtepi32_pd(h)), _mm_cvtepi32_pd(vw)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_sqrt_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2)))),
+                                           _mm_cvtepi32_pd(_mm_shuffle_epi32(vw, _MM_SHUFFLE(1, 0, 3, 2)))));
+    }
+    res = hsum(_mm_add_pd(acc0, acc1));
+#endif
+    for (; len > 0; len--, a++, w++)
+        res += *w * pixelDistF(*a, c);
+    return res;
+}
+
+inline double distSum(const Canvas& a, const Canvas& b) {
+    double res = 0;
+    for (int i = 0; i < a.n; i++)
+        res += distSum(a[i], b[i], a.m);
+    return res;
+}
+
+inline double distSumRect(const Canvas& a, int r1, int c1, int r2, int c2, Pixel c) {
+    double res = 0;
+    for (int i = r1; i < r2; i++)
+        res += distSum(a[i] + c1, c2 - c1, c);
+    return res;
+}
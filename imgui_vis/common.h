@@ -15,11 +15,20 @@ Log& operator<<(Log& l, const T& other) {
 
 Log msg;
 int S = 10;
+int dpThreads = 0; // solveGena workers, 0 = all cores, 1 = the serial loop
+int gridLines = 0; // solveGena cut lines per axis picked from the image, 0 = every S
+int pyramidLines = 80; // solvePyramid stops before a level with more lines per axis
 float T = 0.01;
 int optSeconds = 600;
+int optReplicas = 1; // solveOpt annealing chains, more than 1 runs parallel tempering
+float optLadder = 2; // temperature ratio between neighbouring chains
 bool optRunning;
+bool optResume; // the next solveOpt goes on from optSnapshot
+string optSnapshot; // solveOpt state of the current test, next to its input
+int snapshotSeconds = 60; // how often solveOpt saves it, 0 = never
 bool hardMove;
 bool regionOpt = true;
+int regionWorkers = 1; // solveOpt threads sharing the regions, more than 1 optimizes them concurrently
 bool hardRects;
 int drawR1, drawR2, drawC1, drawC2;
 int hardIters = 5000;
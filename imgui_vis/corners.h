@@ -0,0 +1,270 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// The paint order of solveOpt's corners (cells of an n x n grid), with
+// logarithmic insert, erase, k-th corner and position queries: an implicit
+// treap keyed by order, one node per cell.
+// Corners also carry order labels that are kept increasing along the
+// sequence, so comparing the order of two corners is O(1). A 2D segment tree
+// over the cells keeps, per quadrant, the latest and the earliest corner by
+// label; relabeling keeps the order, so it never has to be rebuilt.
+class CornerOrder {
+  public:
+    void reset(int n_) {
+        n = n_;
+        size_t cells = size_t(n) * n + 1;
+        l.assign(cells, 0);
+        r.assign(cells, 0);
+        p.assign(cells, 0);
+        sz.assign(cells, 0);
+        pri.assign(cells, 0);
+        pt.assign(cells, {0, 0});
+        lab.assign(cells, -1);
+        quad.assign(size_t(2 * n) * 2 * n, {0, 0});
+        root = 0;
+        seed = 0x9e3779b97f4a7c15ull;
+    }
+
+    int size() const { return sz[root]; }
+    bool empty() const { return root == 0; }
+
+    const pair<int, int>& operator[](int k) const { return pt[kth(k)]; }
+
+    // Increases along the order; -1 for a cell that is not a corner.
+    int label(pair<int, int> c) const { return lab[node(c)]; }
+
+    int position(pair<int, int> c) const {
+        int t = node(c);
+        int pos = sz[l[t]];
+        for (; p[t]; t = p[t])
+            if (r[p[t]] == t) pos += sz[l[p[t]]] + 1;
+        return pos;
+    }
+
+    void insert(int pos, pair<int, int> c) {
+        int t = node(c);
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        pri[t] = uint32_t(seed);
+        pt[t] = c;
+        // descend while the nodes on the way keep priority over t
+        int parent = 0;
+        int* link = &root;
+        while (*link && pri[*link] >= pri[t]) {
+            parent = *link;
+            sz[parent]++;
+            if (pos <= sz[l[parent]]) {
+                link = &l[parent];
+            } else {
+                pos -= sz[l[parent]] + 1;
+                link = &r[parent];
+            }
+        }
+        split(*link, pos, l[t], r[t]);
+        pull(t);
+        p[t] = parent;
+        *link = t;
+
+        int a = prev(t), b = next(t);
+        int before = a ? lab[a] : 0;
+        int after = b ? lab[b] : kMaxLabel;
+        if (after - before >= 2) lab[t] = before + (after - before) / 2;
+        else relabel();
+        place(c, t);
+    }
+
+    void erase(pair<int, int> c) {
+        int t = node(c);
+        int m = merge(l[t], r[t]);
+        int parent = p[t];
+        if (m) p[m] = parent;
+        if (!parent) root = m;
+        else (l[parent] == t ? l[parent] : r[parent]) = m;
+        for (int q = parent; q; q = p[q])
+            sz[q]--;
+        unplace(c, t);
+        l[t] = r[t] = p[t] = sz[t] = 0;
+        lab[t] = -1;
+    }
+
+    // The positions [L, R] where c can go without breaking the order: after
+    // every corner it dominates (both coordinates <=) and before every corner
+    // dominating it. A corner does not bound itself, so for one already in
+    // the order this is where it could move to.
+    pair<int, int> window(pair<int, int> c) const {
+        int a, b;
+        if (lab[node(c)] < 0) {
+            a = extreme(kLatest, 0, c.first + 1, 0, c.second + 1);
+            b = extreme(kEarliest, c.first, n, c.second, n);
+        } else {
+            a = pick(kLatest, extreme(kLatest, 0, c.first, 0, c.second + 1), extreme(kLatest, c.first, c.first + 1, 0, c.second));
+            b = pick(kEarliest, extreme(kEarliest, c.first + 1, n, c.second, n), extreme(kEarliest, c.first, c.first + 1, c.second + 1, n));
+        }
+        return {a ? position(pt[a]) + 1 : 0, b ? position(pt[b]) : size()};
+    }
+
+    class iterator {
+      public:
+        iterator(const CornerOrder* o, int t) : o(o), t(t) {}
+        const pair<int, int>& operator*() const { return o->pt[t]; }
+        iterator& operator++() {
+            t = o->next(t);
+            return *this;
+        }
+        bool operator!=(const iterator& other) const { return t != other.t; }
+
+      private:
+        const CornerOrder* o;
+        int t;
+    };
+    iterator begin() const {
+        int t = root;
+        while (t && l[t]) t = l[t];
+        return iterator(this, t);
+    }
+    iterator end() const { return iterator(this, 0); }
+
+  private:
+    static constexpr int kMaxLabel = 1 << 30;
+    enum { kLatest, kEarliest };
+
+    int node(pair<int, int> c) const { return c.first * n + c.second + 1; }
+
+    int kth(int k) const {
+        int t = root;
+        while (true) {
+            if (k < sz[l[t]]) {
+                t = l[t];
+            } else if (k == sz[l[t]]) {
+                return t;
+            } else {
+                k -= sz[l[t]] + 1;
+                t = r[t];
+            }
+        }
+    }
+
+    int next(int t) const {
+        if (r[t]) {
+            for (t = r[t]; l[t];) t = l[t];
+            return t;
+        }
+        while (p[t] && r[p[t]] == t) t = p[t];
+        return p[t];
+    }
+
+    int prev(int t) const {
+        if (l[t]) {
+            for (t = l[t]; r[t];) t = r[t];
+            return t;
+        }
+        while (p[t] && l[p[t]] == t) t = p[t];
+        return p[t];
+    }
+
+    void pull(int t) {
+        sz[t] = 1 + sz[l[t]] + sz[r[t]];
+        if (l[t]) p[l[t]] = t;
+        if (r[t]) p[r[t]] = t;
+    }
+
+    // a gets the first k corners of t, b the rest
+    void split(int t, int k, int& a, int& b) {
+        if (!t) {
+            a = b = 0;
+            return;
+        }
+        if (sz[l[t]] >= k) {
+            split(l[t], k, a, l[t]);
+            b = t;
+        } else {
+            split(r[t], k - sz[l[t]] - 1, r[t], b);
+            a = t;
+        }
+        pull(t);
+    }
+
+    int merge(int a, int b) {
+        if (!a || !b) return a ? a : b;
+        if (pri[a] > pri[b]) {
+            r[a] = merge(r[a], b);
+            pull(a);
+            return a;
+        }
+        l[b] = merge(a, l[b]);
+        pull(b);
+        return b;
+    }
+
+    // spreads the labels evenly once two neighbours ran out of room
+    void relabel() {
+        int step = kMaxLabel / (size() + 1), cur = 0;
+        for (auto it = begin(); it != end(); ++it)
+            lab[node(*it)] = cur += step;
+    }
+
+    int pick(int which, int a, int b) const {
+        if (!a || !b) return a | b;
+        return (lab[a] > lab[b]) == (which == kLatest) ? a : b;
+    }
+
+    // Adds corner t at cell c to both quadrant trees, which share one array
+    // so their walks share cache lines. The x tree node X holds a y tree in
+    // quad[X * 2n ..], bottom-up with leaves at n. Walks stop at the first
+    // node t does not win, as no node above it changes.
+    void place(pair<int, int> c, int t) {
+        for (int w = 0; w < 2; w++) {
+            for (int x = c.first + n; x > 0; x >>= 1) {
+                auto* row = &quad[size_t(x) * 2 * n];
+                int y = c.second + n;
+                if (pick(w, row[y][w], t) != t) break;
+                for (; y > 0 && pick(w, row[y][w], t) == t; y >>= 1)
+                    row[y][w] = t;
+            }
+        }
+    }
+
+    // Takes corner t at cell c out again, recomputing only the nodes t won.
+    void unplace(pair<int, int> c, int t) {
+        for (int w = 0; w < 2; w++) {
+            for (int x = c.first + n; x > 0; x >>= 1) {
+                auto* row = &quad[size_t(x) * 2 * n];
+                int y = c.second + n;
+                if (row[y][w] != t) break;
+                row[y][w] = x >= n ? 0 : pick(w, quad[size_t(2 * x) * 2 * n + y][w], quad[size_t(2 * x + 1) * 2 * n + y][w]);
+                for (y >>= 1; y > 0 && row[y][w] == t; y >>= 1)
+                    row[y][w] = pick(w, row[2 * y][w], row[2 * y + 1][w]);
+            }
+        }
+    }
+
+    // The latest or earliest corner in columns [x1, x2) and rows [y1, y2).
+    int extreme(int which, int x1, int x2, int y1, int y2) const {
+        int res = 0;
+        auto scan = [&](int x) {
+            auto* row = &quad[size_t(x) * 2 * n];
+            for (int a = y1 + n, b = y2 + n; a < b; a >>= 1, b >>= 1) {
+                if (a & 1) res = pick(which, res, row[a++][which]);
+                if (b & 1) res = pick(which, res, row[--b][which]);
+            }
+        };
+        for (int a = x1 + n, b = x2 + n; a < b; a >>= 1, b >>= 1) {
+            if (a & 1) scan(a++);
+            if (b & 1) scan(--b);
+        }
+        return res;
+    }
+
+    int n = 0, root = 0;
+    uint64_t seed = 0;
+    vector<int> l, r, p, sz;
+    vector<uint32_t> pri;
+    vector<pair<int, int>> pt;
+    vector<int> lab;
+    vector<array<int, 2>> quad; // [kLatest], [kEarliest]
+};
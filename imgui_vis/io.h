@@ -0,0 +1,478 @@
+#pragma once
+
+#include "painter.h"
+#include "parallel.h"
+
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct Input {
+    int N, M;
+    Canvas colors, initialColors;
+    vector<RawBlock> rawBlocks;
+    Costs costs;
+};
+
+void readCanvas(istream& in, Canvas& cv, int n, int m) {
+    cv = Canvas(n, m);
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < m; j++)
+            for (int q = 0; q < 4; q++) {
+                int v = 0;
+                in >> v;
+                cv[i][j][q] = v;
+            }
+}
+
+Input readInputText(const string& fname) {
+    Input res;
+
+    ifstream fin(fname);
+    fin >> res.N >> res.M;
+    readCanvas(fin, res.colors, res.N, res.M);
+
+    int B;
+    fin >> B;
+    for (int i = 0; i < B; i++) {
+        res.rawBlocks.push_back(RawBlock{});
+        auto& b = res.rawBlocks.back();
+        string id;
+        fin >> id >> b.blX >> b.blY >> b.trX >> b.trY >> b.r >> b.g >> b.b >> b.a;
+        b.id = blockIds.parse(id);
+    }
+
+    readCanvas(fin, res.initialColors, res.N, res.M);
+
+    fin >> res.costs.splitLine >> res.costs.splitPoint >> res.costs.color >> res.costs.swap >> res.costs.merge;
+
+    fin.close();
+    return res;
+}
+
+// Writes fname under a temporary name in the same directory and renames it
+// into place, so readers see either the old file or the whole new one.
+bool writeAtomically(const string& fname, const function<void(ostream&)>& write) {
+    size_t salt = hash<thread::id>()(this_thread::get_id()) ^ Time::now().time_since_epoch().count();
+    string tmp = fname + ".tmp" + to_string(salt % 1000000007);
+    {
+        ofstream out(tmp, ios::binary);
+        write(out);
+        out.close();
+        if (!out) {
+            error_code ec;
+            filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    error_code ec;
+    filesystem::rename(tmp, fname, ec);
+    if (ec) filesystem::remove(tmp, ec);
+    return !ec;
+}
+
+// Plain values and vectors of them (length first) as raw bytes, for files
+// only this program reads back, like the optimizer snapshots.
+template <class T>
+void writeRaw(ostream& out, const T& x) {
+    out.write((const char*)&x, sizeof(T));
+}
+
+template <class T>
+void writeRaw(ostream& out, const vector<T>& v) {
+    writeRaw(out, int64_t(v.size()));
+    out.write((const char*)v.data(), v.size() * sizeof(T));
+}
+
+template <class T>
+bool readRaw(istream& in, T& x) {
+    return bool(in.read((char*)&x, sizeof(T)));
+}
+
+template <class T>
+bool readRaw(istream& in, vector<T>& v) {
+    int64_t len;
+    if (!readRaw(in, len) || len < 0 || len > (int64_t(1) << 28)) return false;
+    v.resize(len);
+    return bool(in.read((char*)v.data(), len * sizeof(T)));
+}
+
+// Binary cache of an input, written next to it as <id>.bin:
+//   BinHeader, B x BinBlock, zero padding up to a multiple of 32 bytes,
+//   N*M target pixels, N*M initial pixels (row-major RGBA, as in Canvas).
+constexpr char kBinMagic[8] = {'I', 'C', 'P', 'B', 'I', 'N', '0', '1'};
+
+struct BinHeader {
+    char magic[8];
+    int32_t n, m, blocks, pad;
+    Costs costs;
+};
+
+struct BinBlock {
+    char id[32];
+    int32_t blX, blY, trX, trY, r, g, b, a;
+};
+
+size_t binPlanesOffset(int blocks) {
+    return (sizeof(BinHeader) + blocks * sizeof(BinBlock) + 31) / 32 * 32;
+}
+
+string binPath(const string& fname) {
+    return filesystem::path(fname).replace_extension(".bin").string();
+}
+
+// Maps the whole file copy-on-write, so canvases built on top of it can be
+// written to without touching the file. Returns nullptr on failure.
+shared_ptr<void> mapFile(const string& fname, size_t& size) {
+#ifndef _WIN32
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    size = st.st_size;
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return nullptr;
+    return shared_ptr<void>(p, [size](void* q) { munmap(q, size); });
+#else
+    ifstream fin(fname, ios::binary | ios::ate);
+    if (!fin) return nullptr;
+    size = fin.tellg();
+    shared_ptr<void> buf(_aligned_malloc(max<size_t>(size, 32), 32), _aligned_free);
+    fin.seekg(0);
+    fin.read((char*)buf.get(), size);
+    return fin ? buf : nullptr;
+#endif
+}
+
+bool writeInputBinary(const Input& in, const string& fname) {
+    BinHeader h{};
+    memcpy(h.magic, kBinMagic, 8);
+    h.n = in.N;
+    h.m = in.M;
+    h.blocks = in.rawBlocks.size();
+    h.costs = in.costs;
+    vector<BinBlock> blocks;
+    for (const auto& b : in.rawBlocks) {
+        BinBlock bb{};
+        string id = blockIds.str(b.id);
+        if (id.size() >= sizeof(bb.id)) return false;
+        memcpy(bb.id, id.data(), id.size());
+        bb.blX = b.blX; bb.blY = b.blY; bb.trX = b.trX; bb.trY = b.trY;
+        bb.r = b.r; bb.g = b.g; bb.b = b.b; bb.a = b.a;
+        blocks.push_back(bb);
+    }
+    return writeAtomically(fname, [&](ostream& out) {
+        out.write((const char*)&h, sizeof(h));
+        out.write((const char*)blocks.data(), blocks.size() * sizeof(BinBlock));
+        string pad(binPlanesOffset(h.blocks) - sizeof(h) - blocks.size() * sizeof(BinBlock), '\0');
+        out.write(pad.data(), pad.size());
+        out.write((const char*)in.colors.data, in.colors.bytes());
+        out.write((const char*)in.initialColors.data, in.initialColors.bytes());
+    });
+}
+
+// Loads a cache written by writeInputBinary; the canvases point into the
+// mapping. Returns false if the file is missing or does not look right.
+bool readInputBinary(const string& fname, Input& res) {
+    size_t size = 0;
+    auto file = mapFile(fname, size);
+    if (!file || size < sizeof(BinHeader)) return false;
+    const char* base = (const char*)file.get();
+    BinHeader h;
+    memcpy(&h, base, sizeof(h));
+    if (memcmp(h.magic, kBinMagic, 8) != 0 || h.n <= 0 || h.m <= 0 || h.blocks < 0) return false;
+    size_t planes = binPlanesOffset(h.blocks);
+    size_t plane = size_t(h.n) * h.m * sizeof(Pixel);
+    if (size != planes + 2 * plane) return false;
+
+    res.N = h.n;
+    res.M = h.m;
+    res.costs = h.costs;
+    res.rawBlocks.clear();
+    const BinBlock* blocks = (const BinBlock*)(base + sizeof(BinHeader));
+    for (int i = 0; i < h.blocks; i++) {
+        const BinBlock& bb = blocks[i];
+        BlockId id = blockIds.parse(bb.id, bb.id + strnlen(bb.id, sizeof(bb.id)));
+        if (id < 0) return false;
+        res.rawBlocks.push_back(RawBlock{id, bb.blX, bb.blY, bb.trX, bb.trY, bb.r, bb.g, bb.b, bb.a});
+    }
+    Pixel* pixels = (Pixel*)(base + planes);
+    res.colors = Canvas::view(h.n, h.m, pixels, file);
+    res.initialColors = Canvas::view(h.n, h.m, pixels + size_t(h.n) * h.m, file);
+    return true;
+}
+
+// Reads an input through its binary cache, (re)building the cache from the
+// text file when it is missing or older than the text.
+Input readInput(const string& fname) {
+    Input res;
+    string bin = binPath(fname);
+    error_code ec;
+    auto textTime = filesystem::last_write_time(fname, ec);
+    bool fresh = !ec && filesystem::exists(bin, ec) && filesystem::last_write_time(bin, ec) >= textTime && !ec;
+    if (fresh && readInputBinary(bin, res))
+        return res;
+    res = readInputText(fname);
+    if (!writeInputBinary(res, bin))
+        cerr << "Could not write input cache " << bin << "\n";
+    return res;
+}
+
+// Single-pass ISL tokenizer over an in-memory buffer. Nothing is allocated
+// per line; on malformed input error() gives "line:col: what".
+struct IslReader {
+    const char* p;
+    const char* e;
+    const char* lineStart;
+    int line = 1;
+    string err;
+
+    IslReader(const char* begin, const char* end) : p(begin), e(end), lineStart(begin) {}
+
+    bool fail(const char* what) {
+        err = to_string(line) + ":" + to_string(p - lineStart + 1) + ": " + what;
+        return false;
+    }
+
+    void skipSpaces() {
+        while (p != e && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    }
+
+    // skips blank lines and # comments, false at end of input
+    bool nextLine() {
+        while (true) {
+            skipSpaces();
+            if (p != e && *p == '#')
+                while (p != e && *p != '\n') p++;
+            if (p == e) return false;
+            if (*p != '\n') return true;
+            p++;
+            line++;
+            lineStart = p;
+        }
+    }
+
+    bool endLine() {
+        skipSpaces();
+        if (p == e) return true;
+        if (*p != '\n') return fail("expected end of line");
+        p++;
+        line++;
+        lineStart = p;
+        return true;
+    }
+
+    bool expect(char c) {
+        skipSpaces();
+        if (p == e || *p != c) {
+            static const char* what[] = {"expected '['", "expected ']'", "expected ','"};
+            return fail(what[c == '[' ? 0 : c == ']' ? 1 : 2]);
+        }
+        p++;
+        return true;
+    }
+
+    bool word(const char* w) {
+        const char* q = p;
+        for (; *w; w++, q++)
+            if (q == e || *q != *w) return false;
+        if (q != e && isalpha((unsigned char)*q)) return false;
+        p = q;
+        return true;
+    }
+
+    bool number(int& v) {
+        skipSpaces();
+        bool neg = p != e && *p == '-';
+        if (neg) p++;
+        if (p == e || !isdigit((unsigned char)*p)) return fail("expected a number");
+        ll x = 0;
+        for (; p != e && isdigit((unsigned char)*p); p++) {
+            x = x * 10 + (*p - '0');
+            if (x > INT_MAX) return fail("number out of range");
+        }
+        v = neg ? -x : x;
+        return true;
+    }
+
+    bool bracketNumber(int& v) { return expect('[') && number(v) && expect(']'); }
+
+    bool blockId(BlockId& id) {
+        if (!expect('[')) return false;
+        skipSpaces();
+        const char* s = p;
+        while (p != e && (isdigit((unsigned char)*p) || *p == '.')) p++;
+        id = blockIds.parse(s, p);
+        if (id < 0) {
+            p = s;
+            return fail("bad block id");
+        }
+        return expect(']');
+    }
+
+    bool instruction(Instruction& ins) {
+        BlockId id, oid;
+        if (word("cut")) {
+            if (!blockId(id) || !expect('[')) return false;
+            skipSpaces();
+            if (p != e && (*p == 'X' || *p == 'x' || *p == 'Y' || *p == 'y')) {
+                bool isX = *p == 'X' || *p == 'x';
+                p++;
+                int v = 0;
+                if (!expect(']') || !bracketNumber(v)) return false;
+                ins = isX ? SplitXIns(id, v) : SplitYIns(id, v);
+                return true;
+            }
+            int x = 0, y = 0;
+            if (!number(x) || !expect(',') || !number(y) || !expect(']')) return false;
+            ins = SplitPointIns(id, x, y);
+            return true;
+        }
+        if (word("merge")) {
+            if (!blockId(id) || !blockId(oid)) return false;
+            ins = MergeIns(id, oid);
+            return true;
+        }
+        if (word("swap")) {
+            if (!blockId(id) || !blockId(oid)) return false;
+            ins = SwapIns(id, oid);
+            return true;
+        }
+        if (word("color")) {
+            Color c;
+            if (!blockId(id) || !expect('[')) return false;
+            for (int q = 0; q < 4; q++)
+                if ((q && !expect(',')) || !number(c[q])) return false;
+            if (!expect(']')) return false;
+            ins = ColorIns(id, c);
+            return true;
+        }
+        return fail("unknown instruction");
+    }
+
+    bool readAll(vector<Instruction>& ins) {
+        while (nextLine()) {
+            ins.emplace_back();
+            if (!instruction(ins.back()) || !endLine()) {
+                ins.pop_back();
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Parses an ISL file into ins. Returns false (and reports where) if the file
+// is malformed; a missing or empty file is an empty solution.
+bool readSolution(const string& filepath, vector<Instruction>& ins) {
+    size_t size = 0;
+    auto file = mapFile(filepath, size);
+    if (!file)
+        return true;
+    const char* base = (const char*)file.get();
+    IslReader reader(base, base + size);
+    if (!reader.readAll(ins)) {
+        cerr << filepath << ":" << reader.err << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Replays ins on p, returns false on the first instruction the painter rejects.
+bool replaySolution(Painter& p, const vector<Instruction>& ins, const string& filepath) {
+    for (const auto& i : ins) {
+        if (!p.doInstruction(i)) {
+            cerr << "Bad instruction in " + filepath + ": " + i.text() + "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// "../inputs/12.txt" -> 12, -1 if the file name is not a number.
+int testIdFromPath(const string& path) {
+    string stem = filesystem::path(path).stem().string();
+    if (stem.empty() || stem.find_first_not_of("0123456789") != string::npos)
+        return -1;
+    return stoi(stem);
+}
+
+// Formats the whole file into one buffer (reused by the calling thread) and
+// writes it with a single atomic replace.
+bool writeSolution(const string& fname, const vector<Instruction>& ins) {
+    thread_local string buf;
+    buf.clear();
+    for (const auto& i : ins) {
+        i.appendText(buf);
+        buf += '\n';
+    }
+    return writeAtomically(fname, [&](ostream& out) { out.write(buf.data(), buf.size()); });
+}
+
+bool writeLocalScores(const unordered_map<int, int>& scores) {
+    vector<pair<int, int>> sorted(scores.begin(), scores.end());
+    sort(sorted.begin(), sorted.end());
+    string buf;
+    for (auto [id, sc] : sorted) {
+        appendInt(id, buf);
+        buf += ' ';
+        appendInt(sc, buf);
+        buf += '\n';
+    }
+    return writeAtomically("local_scores.txt", [&](ostream& out) { out.write(buf.data(), buf.size()); });
+}
+
+struct LocalScore {
+    int testId;
+    int score;        // -1 if there is no solution file, -100 if it is invalid
+    int instructions;
+    double readMs, replayMs;
+};
+
+// Scores every inputs/<id>.txt against solutions/<id>.txt, one test per worker.
+vector<LocalScore> scoreLocal(const string& inputsPath, const string& solutionsPath, int threads = 0) {
+    vector<pair<int, string>> tests;
+    for (const auto& entry : filesystem::directory_iterator(inputsPath)) {
+        string s = entry.path().string();
+        if (entry.path().extension() != ".txt") continue;
+        int id = testIdFromPath(s);
+        if (id >= 0) tests.emplace_back(id, s);
+    }
+    sort(tests.begin(), tests.end());
+
+    vector<LocalScore> res(tests.size());
+    parallelFor(tests.size(), [&](int t) {
+        auto [id, path] = tests[t];
+        auto& r = res[t];
+        r = LocalScore{id, -1, 0, 0, 0};
+        string solPath = solutionsPath + to_string(id) + ".txt";
+        if (!filesystem::exists(solPath))
+            return;
+        auto start = Time::now();
+        Input in = readInput(path);
+        vector<Instruction> ins;
+        bool ok = readSolution(solPath, ins);
+        r.instructions = ins.size();
+        auto parsed = Time::now();
+        r.readMs = chrono::duration<double, milli>(parsed - start).count();
+        Painter p(in.N, in.M, in.rawBlocks, in.colors, in.costs);
+        ok = ok && replaySolution(p, ins, solPath);
+        r.score = ok ? p.totalScore() : -100;
+        r.replayMs = chrono::duration<double, milli>(Time::now() - parsed).count();
+    }, threads);
+    return res;
+}
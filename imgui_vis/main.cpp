@@ -44,6 +44,7 @@ using Color = array<int, 4>;
 
 #include "api.h"
 #include "solutions.h"
+#include "io.h"
 
 namespace fs = std::filesystem;
 const string inputsPath = "../inputs/";
@@ -74,37 +75,6 @@ double shiftX, shiftY;
 bool showCorners;
 int SWr1, SWc1, SWr2, SWc2, SWsr, SWsc;
 
-Input readInput(const string& fname) {
-    Input res;
-
-    ifstream fin(fname);
-    fin >> res.N >> res.M;
-    res.colors.assign(res.N, vector<Color>(res.M, Color()));
-    for (int i = 0; i < res.N; i++)
-        for (int j = 0; j < res.M; j++)
-            for (int q = 0; q < 4; q++)
-                fin >> res.colors[i][j][q];
-
-    int B;
-    fin >> B;
-    for (int i = 0; i < B; i++) {
-        res.rawBlocks.push_back(RawBlock{});
-        auto& b = res.rawBlocks.back();
-        fin >> b.id >> b.blX >> b.blY >> b.trX >> b.trY >> b.r >> b.g >> b.b >> b.a;
-    }
-
-    res.initialColors.assign(res.N, vector<Color>(res.M, Color()));
-    for (int i = 0; i < res.N; i++)
-        for (int j = 0; j < res.M; j++)
-            for (int q = 0; q < 4; q++)
-                fin >> res.initialColors[i][j][q];
-
-    fin >> res.costs.splitLine >> res.costs.splitPoint >> res.costs.color >> res.costs.swap >> res.costs.merge;
-
-    fin.close();
-    return res;
-}
-
 Input readInputAndStoreAsGlobal(const string& fname) {
     Input i = readInput(fname);
     N = i.N;
@@ -113,11 +83,15 @@ Input readInputAndStoreAsGlobal(const string& fname) {
     rawBlocks = i.rawBlocks;
     initialColors = i.initialColors;
     costs = i.costs;
+    auto cache = make_shared<RectCache>();
+    cache->open(RectCache::pathFor(fname), colors);
+    atomic_store(&rectCache, cache);
+    optSnapshot = filesystem::path(fname).replace_extension(".opt").string();
     return i;
 }
 
 void postprocess(Solution& res) {
-    painter = Painter(N, M, rawBlocks);
+    painter = Painter(N, M, rawBlocks, colors, costs);
     if (SWsr == 0 && SWsc == 0) {
         while (!res.ins.empty() && res.ins.back().type != tColor) {
           res.ins.pop_back();
@@ -125,14 +99,16 @@ void postprocess(Solution& res) {
     } else {
         if (SWsr == N) {
             assert(res.ins.back().type == tMerge);
-            int last = max(stoi(res.ins.back().id), stoi(res.ins.back().oid)) + 1;
-            string lastId = to_string(last);
+            int last = max(blockIds.number(res.ins.back().id), blockIds.number(res.ins.back().oid)) + 1;
+            BlockId lastId = blockIds.root(last);
+            BlockId lastId1 = blockIds.child(lastId, 1);
+            BlockId lastId11 = blockIds.child(lastId1, 1);
             if (SWc1 > SWc2) swap(SWc1, SWc2);
             assert(SWc1 == 0);
             res.ins.push_back(SplitXIns(lastId, SWc1 + SWsc));
-            res.ins.push_back(SplitXIns(lastId + ".1", SWc2));
-            res.ins.push_back(SplitXIns(lastId + ".1.1", SWc2 + SWsc));
-            res.ins.push_back(SwapIns(lastId + ".1.1.0", lastId + ".0"));
+            res.ins.push_back(SplitXIns(lastId1, SWc2));
+            res.ins.push_back(SplitXIns(lastId11, SWc2 + SWsc));
+            res.ins.push_back(SwapIns(blockIds.child(lastId11, 0), blockIds.child(lastId, 0)));
             // res.ins.push_back(MergeIns(lastId + ".1.0", lastId + ".0"));
             // ++last;
             // res.ins.push_back(MergeIns(lastId + ".1.1.0", to_string(last)));
@@ -140,14 +116,16 @@ void postprocess(Solution& res) {
             // res.ins.push_back(MergeIns(lastId + ".1.1.1", to_string(last)));
         } else if (SWsc == N) {
             assert(res.ins.back().type == tMerge);
-            int last = max(stoi(res.ins.back().id), stoi(res.ins.back().oid)) + 1;
-            string lastId = to_string(last);
+            int last = max(blockIds.number(res.ins.back().id), blockIds.number(res.ins.back().oid)) + 1;
+            BlockId lastId = blockIds.root(last);
+            BlockId lastId1 = blockIds.child(lastId, 1);
+            BlockId lastId11 = blockIds.child(lastId1, 1);
             if (SWr1 > SWr2) swap(SWr1, SWr2);
             assert(SWr1 == 0);
             res.ins.push_back(SplitYIns(lastId, SWr1 + SWsr));
-            res.ins.push_back(SplitYIns(lastId + ".1", SWr2));
-            res.ins.push_back(SplitYIns(lastId + ".1.1", SWr2 + SWsr));
-            res.ins.push_back(SwapIns(lastId + ".1.1.0", lastId + ".0"));
+            res.ins.push_back(SplitYIns(lastId1, SWr2));
+            res.ins.push_back(SplitYIns(lastId11, SWr2 + SWsr));
+            res.ins.push_back(SwapIns(blockIds.child(lastId11, 0), blockIds.child(lastId, 0)));
         } else {
             cerr << "Not Supported!\n";
             throw 42;
@@ -161,79 +139,28 @@ void postprocess(Solution& res) {
             return;
         }
     }
-    msg << "Painter score: " << painter.totalScore(colors) << "\n";
-    res.score = painter.totalScore(colors);
+    msg << "Painter score: " << painter.totalScore() << "\n";
+    res.score = painter.totalScore();
     coloredBlocks = painter.coloredBlocks;
     if (myScores[currentTestId] == -1 || res.score < myScores[currentTestId]) {
         string fname = "../solutions/" + to_string(currentTestId) + ".txt";
         myScores[currentTestId] = res.score;
-        ofstream ofs(fname);
-        for (const auto& i : res.ins) {
-            ofs << i.text() << endl;
-        }
-        ofs.close();
-
-        ofs = ofstream("local_scores.txt");
-        for (auto [id, sc] : myScores)
-            ofs << id << " " << sc << endl;
-        ofs.close();
+        if (!writeSolution(fname, res.ins) || !writeLocalScores(myScores))
+            msg << "Could not save " << fname << "\n";
     }
 }
 
 pair<Solution, vector<Block>> loadSolution(const Input& in, const string& filepath) {
     Solution res;
     res.score = -1;
-    ifstream infile(filepath);
-    string s, token, id, oid;
-    int val;
-    while (getline(infile, s)) {
-        string cs = "";
-        for (auto c : s)
-            if (c != '[' && c != ']') {
-                if (c == ',') cs += ' ';
-                else cs += c;
-            }
-
-        if (cs.substr(0, 3) == "cut") {
-            stringstream ss(cs.substr(4));
-            ss >> id;
-            ss >> token;
-            ss >> val;
-            // cerr << cs << ": " << id << " " << token << " " << val << "\n"; // << "(" << in.N << " " << in.M << ")" << endl;
-            if (token == "X") {
-                res.ins.push_back(SplitXIns(id, val));
-            } else if (token == "Y") {
-                res.ins.push_back(SplitYIns(id, val));
-            } else {
-                res.ins.push_back(SplitPointIns(id, stoi(token), val));
-            }
-        } else if (cs.substr(0, 5) == "merge") {
-            stringstream ss(cs.substr(6));
-            ss >> id >> oid;
-            res.ins.push_back(MergeIns(id, oid));
-        } else if (cs.substr(0, 4) == "swap") {
-            stringstream ss(cs.substr(5));
-            ss >> id >> oid;
-            res.ins.push_back(SwapIns(id, oid));
-        } else if (cs.substr(0, 5) == "color") {
-            stringstream ss(cs.substr(6));
-            Color c;
-            ss >> id >> c[0] >> c[1] >> c[2] >> c[3];
-            res.ins.push_back(ColorIns(id, c));
-        } else {
-            cerr << "Unsupported instruction: " << cs << " in file " << filepath << "\n";
-            return {res, {}};
-        }
+    if (!readSolution(filepath, res.ins))
+        return {res, {}};
+    Painter p(in.N, in.M, in.rawBlocks, in.colors, in.costs);
+    if (!replaySolution(p, res.ins, filepath)) {
+        res.score = -100;
+        return {res, {}};
     }
-    Painter p(in.N, in.M, in.rawBlocks);
-    for (const auto& ins : res.ins) {
-        if (!p.doInstruction(ins)) {
-            cerr << "Bad instruction in " + s + ": " + ins.text() + "\n";
-            res.score = -100;
-            return {res, {}};
-        }
-    }
-    res.score = p.totalScore(in.colors);
+    res.score = p.totalScore();
     return {res, p.coloredBlocks};
 }
 
@@ -269,10 +196,7 @@ void downloadSolution(int testId) {
     auto [sol, _] = loadSolution(in, solutionsPath + to_string(currentTestId) + ".txt");
     postprocess(sol);
     myScores[testId] = sol.score;
-    ofstream ofs("local_scores.txt");
-    for (auto [id, sc] : myScores)
-        ofs << id << " " << sc << endl;
-    ofs.close();
+    writeLocalScores(myScores);
     cerr << "downloaded and loaded sol for test " << testId << " with score " << sol.score << endl;
 }
 
@@ -285,6 +209,7 @@ void fileWindow() {
         ImGui::SameLine(70);
         if (ImGui::Button("Download Better")) {
             for (const auto & entry : fs::directory_iterator(inputsPath)) {
+                if (entry.path().extension() != ".txt") continue;
                 string s = entry.path().string();
                 size_t i = 0;
                 while (i < s.size() && (s[i] < '0' || s[i] > '9')) i++;
@@ -304,6 +229,7 @@ void fileWindow() {
         ImGui::SameLine(190);
         if (ImGui::Button("Upload Better")) {
             for (const auto & entry : fs::directory_iterator(inputsPath)) {
+                if (entry.path().extension() != ".txt") continue;
                 string s = entry.path().string();
                 size_t i = 0;
                 while (i < s.size() && (s[i] < '0' || s[i] > '9')) i++;
@@ -321,40 +247,16 @@ void fileWindow() {
 
         ImGui::SameLine(300);
         if (ImGui::Button("Read Local")) {
-            for (const auto & entry : fs::directory_iterator(inputsPath)) {
-                string s = entry.path().string();
-                size_t i = 0;
-                while (i < s.size() && (s[i] < '0' || s[i] > '9')) i++;
-                if (i >= s.size()) continue;
-                size_t j = i;
-                while (s[j] >= '0' && s[j] <= '9') j++;
-                int test_id;
-                sscanf(s.substr(i, j).c_str(), "%d", &test_id);
-
-                Input in = readInput(s);
-                cerr << "read input " << in.N << "x" << in.M << endl;
-                auto [sol, _] = loadSolution(in, solutionsPath + to_string(test_id) + ".txt");
-                Painter p(in.N, in.M, in.rawBlocks);
-                for (const auto& ins : sol.ins) {
-                    if (!p.doInstruction(ins)) {
-                        cerr << "Bad instruction in " + s + ": " + ins.text() + "\n";
-                        sol.score = -100;
-                        break;
-                    }
-                }
-                if (sol.score > -99) sol.score = p.totalScore(in.colors);
-                cerr << test_id << " " << sol.score << endl;
-                myScores[test_id] = round(sol.score);
+            for (const auto& r : scoreLocal(inputsPath, solutionsPath)) {
+                cerr << r.testId << " " << r.score << endl;
+                myScores[r.testId] = r.score;
             }
-
-            ofstream ofs("local_scores.txt");
-            for (auto [id, sc] : myScores)
-                ofs << id << " " << sc << endl;
-            ofs.close();
+            writeLocalScores(myScores);
         }
 
         vector<pair<int, string>> tests;
         for (const auto & entry : fs::directory_iterator(inputsPath)) {
+            if (entry.path().extension() != ".txt") continue;
             string s = entry.path().string();
             tests.emplace_back(0, s);
             size_t i = 0;
@@ -390,7 +292,7 @@ void fileWindow() {
                     Input in = readInputAndStoreAsGlobal(tests[idx].second);
                     auto [sol, cb] = loadSolution(in, solutionsPath + to_string(currentTestId) + ".txt");
                     coloredBlocks = cb;
-                    painter = Painter(N, M, rawBlocks);
+                    painter = Painter(N, M, rawBlocks, colors, costs);
                     for (const auto& ins : sol.ins) {
                         if (!painter.doInstruction(ins)) {
                             cerr << "!!! Bad instruction in LOADED SOLUTION: " + ins.text() << endl;
@@ -467,14 +369,15 @@ ImVec2 QP(double x, double y) {
 
 void draw() {
     ImDrawList* dl = ImGui::GetBackgroundDrawList();
+    const Canvas& pc = painter.canvas();
     for (int i = 0; i < N; i++)
         for (int j = 0; j < M; j++) {
-            Color c = colors[N - 1 - i][j];
+            Pixel c = colors[N - 1 - i][j];
             ImU32 color = IM_COL32(c[0], c[1], c[2], c[3]);
             dl->AddRectFilled(QP(j, i), QP((j + 1), (i + 1)), color);
 
-            if (i < (int)painter.clr.size() && j < (int)painter.clr[i].size()) {
-                c = painter.clr[N - 1 - i][j];
+            if (i < pc.n && j < pc.m) {
+                c = pc[N - 1 - i][j];
                 color = IM_COL32(c[0], c[1], c[2], c[3]);
                 dl->AddRectFilled(QP(j + M + 10, i), QP((j + 1 + M + 10), (i + 1)), color);
             }
@@ -603,7 +506,7 @@ void processMouse() {
                 if (cx > M + 5) cx -= M + 10;
                 cy = N - cy - 1;
 
-                coloredBlocks.push_back(Block{cy, cx, N, N, colors[cy][cx]});
+                coloredBlocks.push_back(Block{cy, cx, N, N, toColor(colors[cy][cx])});
                 int idx = coloredBlocks.size() - 1;
                 while (idx > 0 && (coloredBlocks[idx].r1 < coloredBlocks[idx - 1].r1 || coloredBlocks[idx].c1 < coloredBlocks[idx - 1].c1)) {
                     swap(coloredBlocks[idx], coloredBlocks[idx - 1]);
@@ -616,6 +519,39 @@ void processMouse() {
     // }
 }
 
+// One line per solveOpt chain, sampled from its telemetry channel each frame:
+// iterations per second, kept share of each move type and the latest move.
+void telemetryText() {
+    struct Rate { int64_t its = 0; Time::time_point at; double perSec = 0; };
+    static vector<Rate> rates(Telemetry::kMaxChannels);
+    auto now = Time::now();
+    for (int c = 0; c < telemetry.channels(); c++) {
+        const auto& ch = telemetry.channel(c);
+        int64_t its = ch.iterations.load(memory_order_relaxed);
+        auto& r = rates[c];
+        double dt = chrono::duration<double>(now - r.at).count();
+        if (its < r.its) r = Rate{its, now, 0};
+        else if (dt >= 0.5) r = Rate{its, now, (its - r.its) / dt};
+        stringstream line;
+        line << "#" << c << " it " << its << " (" << (int64_t) r.perSec << "/s), cnt: " << ch.corners.load(memory_order_relaxed)
+             << ", total: " << telemetry.base() + ch.total.load(memory_order_relaxed) / 1000
+             << ", best: " << telemetry.base() + ch.best.load(memory_order_relaxed) / 1000
+             << ", time: " << ch.ms.load(memory_order_relaxed) / 1000.0 << "s |";
+        for (int t = 0; t < kMoveTypes; t++) {
+            uint64_t tries = ch.tries[t].load(memory_order_relaxed);
+            uint64_t kept = ch.kept[t].load(memory_order_relaxed);
+            line << " " << moveName(t) << " " << fixed << setprecision(1) << (tries ? 100.0 * kept / tries : 0.0) << "%";
+        }
+        uint64_t events = ch.events.load(memory_order_acquire);
+        auto last = telemetry.events(c, events ? events - 1 : 0);
+        if (!last.empty()) {
+            line << " | last [" << moveName(last.back().type) << "] " << (last.back().kept ? "kept " : "dropped ")
+                 << showpos << last.back().delta / 1000.0;
+        }
+        ImGui::Text("%s", line.str().c_str());
+    }
+}
+
 void optsWindow() {
     static bool runInMainThread = false;
     if (ImGui::Begin("Solution")) {
@@ -623,8 +559,11 @@ void optsWindow() {
         ImGui::Checkbox("Show Corners", &showCorners);
         if (currentTestId >= 1) {
             ImGui::DragInt("DP Step", &S, 1, 2, 200, "S=%d", ImGuiSliderFlags_AlwaysClamp);
-            ImGui::DragInt("Direction", &mode, 1, 0, 3, "D=%d", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::DragInt("Cut lines", &gridLines, 1, 0, 200, gridLines ? "K=%d" : "K=off (use S)", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::DragInt("Direction", &mode, 1, 0, 4, mode == 4 ? "D=all" : "D=%d", ImGuiSliderFlags_AlwaysClamp);
             ImGui::SliderFloat("Temperature", &T, 0.00001f, 0.2f, "T=%.5f");
+            ImGui::SetNextItemWidth(80);
+            ImGui::InputInt("DP threads", &dpThreads, 1, 4);
             ImGui::Checkbox("Run in main thread", &runInMainThread);
 
             if (ImGui::Button("Solve Gena")) {
@@ -678,13 +617,68 @@ void optsWindow() {
                     solveThread.detach();
                 }
             }            
+            ImGui::SameLine(450);
+            if (ImGui::Button("Resume Opt")) {
+                optRunning = true;
+                optResume = true;
+                if (runInMainThread) {
+                    cerr << "Run in main thread!\n";
+                    solveOpt();
+                } else {
+                    cerr << "Spawn thread!\n";
+                    thread solveThread(solveOpt);
+                    solveThread.detach();
+                }
+            }
+
+            if (ImGui::Button("Solve Staircase")) {
+                if (runInMainThread) {
+                    cerr << "Run in main thread!\n";
+                    solveDP2();
+                } else {
+                    cerr << "Spawn thread!\n";
+                    thread solveThread(solveDP2);
+                    solveThread.detach();
+                }
+            }
+            ImGui::SameLine(130);
+            if (ImGui::Button("Pyramid + Opt")) {
+                optRunning = true;
+                auto pipeline = [] {
+                    if (solvePyramid(S, mode)) {
+                        solveOpt();
+                    }
+                };
+                if (runInMainThread) {
+                    cerr << "Run in main thread!\n";
+                    pipeline();
+                } else {
+                    cerr << "Spawn thread!\n";
+                    thread solveThread(pipeline);
+                    solveThread.detach();
+                }
+            }
+            ImGui::SameLine(250);
+            ImGui::SetNextItemWidth(80);
+            ImGui::InputInt("Max lines", &pyramidLines, 1, 10);
 
             ImGui::InputInt("TL, sec", &optSeconds, 1, 10);
+            ImGui::SameLine(250);
+            ImGui::SetNextItemWidth(80);
+            ImGui::InputInt("Replicas", &optReplicas, 1, 4);
+            ImGui::SameLine(420);
+            ImGui::SetNextItemWidth(80);
+            ImGui::SliderFloat("Ladder", &optLadder, 1.0f, 4.0f, "x%.2f");
+            ImGui::SameLine(600);
+            ImGui::SetNextItemWidth(80);
+            ImGui::InputInt("Snapshot, sec", &snapshotSeconds, 10, 60);
             ImGui::Checkbox("Optimize by regions", &regionOpt);
             ImGui::SameLine(180);
             ImGui::Checkbox("Hard Rect Optimize", &hardRects);
             ImGui::SameLine(350);
             ImGui::InputInt("HardIters", &hardIters, 1, 100000000);
+            ImGui::SetNextItemWidth(80);
+            ImGui::InputInt("Region workers", &regionWorkers, 1, 4);
 
             ImGui::SetNextItemWidth(80);
             ImGui::InputInt("RS", &RS, 1, 400); 
@@ -708,6 +702,12 @@ void optsWindow() {
             ImGui::InputText("r1 c1 r2 c2 sr sc", buf, IM_ARRAYSIZE(buf));
 
 
+            if (ImGui::Button("Export telemetry")) {
+                string fname = optSnapshot.empty() ? "telemetry.csv" : filesystem::path(optSnapshot).replace_extension(".csv").string();
+                if (telemetry.writeCsv(fname)) msg << "Telemetry saved to " << fname << "\n";
+                else msg << "Could not save " << fname << "\n";
+            }
+            telemetryText();
             ImGui::Text("%s\n%s", msg.s.str().c_str(), requestResult.c_str());
         }
     }
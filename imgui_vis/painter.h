@@ -0,0 +1,654 @@
+#pragma once
+
+#include "canvas.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+constexpr int tColor = 1;
+constexpr int tSplitPoint = 2;
+constexpr int tSplitX = 3;
+constexpr int tSplitY = 4;
+constexpr int tMerge = 5;
+constexpr int tSwap = 6;
+
+void appendInt(int v, string& out) {
+    char buf[12];
+    int len = 0;
+    unsigned u = v < 0 ? 0u - unsigned(v) : unsigned(v);
+    do {
+        buf[len++] = char('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) out += '-';
+    while (len) out += buf[--len];
+}
+
+// Block ids ("7", "12.0.3") are interned into a tree: a root per numeric id and
+// a child per cut index. Everything past the parser works on the integer handles,
+// only text() and the parser ever see the dotted strings. Handles are never freed,
+// node storage is chunked so lookups of existing nodes need no lock.
+using BlockId = int;
+
+struct BlockIds {
+    static constexpr int kChunkBits = 16;
+    static constexpr int kChunk = 1 << kChunkBits;
+    static constexpr int kMaxChunks = 1 << 12;
+
+    struct Node {
+        int parent; // -1 for roots
+        int index;  // numeric id for roots, cut index otherwise
+        atomic<int> child[4];
+    };
+
+    unique_ptr<Node[]> nodes[kMaxChunks];
+    unique_ptr<atomic<int>[]> roots[kMaxChunks];
+    int count = 0;
+    mutex mu;
+
+    const Node& node(BlockId id) const { return nodes[id >> kChunkBits][id & (kChunk - 1)]; }
+    Node& node(BlockId id) { return nodes[id >> kChunkBits][id & (kChunk - 1)]; }
+
+    BlockId create(int parent, int index) {
+        if ((count & (kChunk - 1)) == 0) {
+            assert((count >> kChunkBits) < kMaxChunks);
+            nodes[count >> kChunkBits].reset(new Node[kChunk]);
+        }
+        Node& n = node(count);
+        n.parent = parent;
+        n.index = index;
+        for (int k = 0; k < 4; k++)
+            n.child[k].store(-1, memory_order_relaxed);
+        return count++;
+    }
+
+    BlockId root(int number) {
+        assert(number >= 0 && (number >> kChunkBits) < kMaxChunks);
+        auto& chunk = roots[number >> kChunkBits];
+        if (chunk) {
+            int id = chunk[number & (kChunk - 1)].load(memory_order_acquire);
+            if (id != -1) return id;
+        }
+        lock_guard<mutex> lock(mu);
+        if (!chunk) {
+            chunk.reset(new atomic<int>[kChunk]);
+            for (int i = 0; i < kChunk; i++)
+                chunk[i].store(-1, memory_order_relaxed);
+        }
+        auto& slot = chunk[number & (kChunk - 1)];
+        if (slot.load(memory_order_relaxed) == -1)
+            slot.store(create(-1, number), memory_order_release);
+        return slot.load(memory_order_relaxed);
+    }
+
+    BlockId child(BlockId parent, int index) {
+        auto& slot = node(parent).child[index];
+        int id = slot.load(memory_order_acquire);
+        if (id != -1) return id;
+        lock_guard<mutex> lock(mu);
+        if (slot.load(memory_order_relaxed) == -1)
+            slot.store(create(parent, index), memory_order_release);
+        return slot.load(memory_order_relaxed);
+    }
+
+    bool isRoot(BlockId id) const { return node(id).parent < 0; }
+    BlockId parent(BlockId id) const { return node(id).parent; }
+    int index(BlockId id) const { return node(id).index; }
+
+    int number(BlockId id) const {
+        assert(isRoot(id));
+        return node(id).index;
+    }
+
+    // Same parent, different cut index: "5.1.2" -> "5.1.<index>".
+    BlockId sibling(BlockId id, int index) {
+        assert(!isRoot(id));
+        return child(parent(id), index);
+    }
+
+    string str(BlockId id) const {
+        string res;
+        append(id, res);
+        return res;
+    }
+
+    // Appends the dotted form of id to out.
+    void append(BlockId id, string& out) const {
+        if (id < 0) {
+            out += '?';
+        } else if (isRoot(id)) {
+            appendInt(index(id), out);
+        } else {
+            append(parent(id), out);
+            out += '.';
+            out += char('0' + index(id));
+        }
+    }
+
+    // Returns -1 if [s, e) is not a well-formed id.
+    BlockId parse(const char* s, const char* e) {
+        if (s == e || *s < '0' || *s > '9') return -1;
+        int number = 0;
+        for (; s != e && *s >= '0' && *s <= '9'; s++) {
+            number = number * 10 + (*s - '0');
+            if (number >= kChunk * kMaxChunks) return -1;
+        }
+        BlockId id = root(number);
+        while (s != e) {
+            if (e - s < 2 || s[0] != '.' || s[1] < '0' || s[1] > '3') return -1;
+            id = child(id, s[1] - '0');
+            s += 2;
+        }
+        return id;
+    }
+
+    BlockId parse(const string& s) { return parse(s.data(), s.data() + s.size()); }
+};
+
+BlockIds blockIds;
+
+struct RawBlock {
+    BlockId id;
+    int blX, blY, trX, trY;
+    int r, g, b, a;
+};
+
+struct Block {
+    int r1, c1, r2, c2;
+    Color color;
+};
+
+struct Costs {
+    double splitLine, splitPoint, color, swap, merge;
+};
+
+struct Instruction {
+    BlockId id, oid;
+    int type;
+    int x, y;
+    Color color;
+
+    string text() const {
+        string res;
+        appendText(res);
+        return res;
+    }
+
+    // Appends the ISL line for this instruction to out, without a newline.
+    void appendText(string& out) const {
+        auto id = [&](BlockId b) {
+            out += " [";
+            blockIds.append(b, out);
+            out += ']';
+        };
+        if (type == tColor) {
+            out += "color";
+            id(this->id);
+            out += " [";
+            for (int q = 0; q < 4; q++) {
+                if (q) out += ", ";
+                appendInt(color[q], out);
+            }
+            out += ']';
+        } else if (type == tSplitPoint) {
+            out += "cut";
+            id(this->id);
+            out += " [";
+            appendInt(x, out);
+            out += ", ";
+            appendInt(y, out);
+            out += ']';
+        } else if (type == tSplitX || type == tSplitY) {
+            out += "cut";
+            id(this->id);
+            out += type == tSplitX ? " [X] [" : " [Y] [";
+            appendInt(type == tSplitX ? x : y, out);
+            out += ']';
+        } else if (type == tMerge || type == tSwap) {
+            out += type == tMerge ? "merge" : "swap";
+            id(this->id);
+            id(oid);
+        } else assert(false);
+    }
+};
+
+Instruction ColorIns(BlockId i, Color c) {
+    Instruction res;
+    res.type = tColor;
+    res.id = i;
+    res.color = c;
+    return res;
+}
+
+Instruction SplitPointIns(BlockId i, int x, int y) {
+    Instruction res;
+    res.type = tSplitPoint;
+    res.id = i;
+    res.x = x;
+    res.y = y;
+    return res;
+}
+
+Instruction SplitXIns(BlockId i, int x) {
+    Instruction res;
+    res.type = tSplitX;
+    res.id = i;
+    res.x = x;
+    return res;
+}
+
+Instruction SplitYIns(BlockId i, int y) {
+    Instruction res;
+    res.type = tSplitY;
+    res.id = i;
+    res.y = y;
+    return res;
+}
+
+Instruction MergeIns(BlockId i1, BlockId i2) {
+    Instruction res;
+    res.type = tMerge;
+    res.id = i1;
+    res.oid = i2;
+    return res;
+}
+
+Instruction SwapIns(BlockId i1, BlockId i2) {
+    Instruction res;
+    res.type = tSwap;
+    res.id = i1;
+    res.oid = i2;
+    return res;
+}
+
+// Pixel distances are summed in fixed point, so a running total updated in any
+// order is bit-identical to a full rescan and never drifts.
+constexpr double kDistUnit = 1.0 / (1ll << 30);
+
+ll pixelDist(const Pixel& a, const Pixel& b) {
+    static const vector<ll> table = [] {
+        vector<ll> t(255 * 255 * 4 + 1);
+        for (size_t d = 0; d < t.size(); d++)
+            t[d] = llround(sqrt(double(d)) / kDistUnit);
+        return t;
+    }();
+    int d = 0;
+    for (int q = 0; q < 4; q++)
+        d += sqr(int(a[q]) - int(b[q]));
+    return d < (int)table.size() ? table[d] : llround(sqrt(double(d)) / kDistUnit);
+}
+
+struct Painter {
+    int lastBlockId;
+    int N, M;
+    // indexed by BlockId, live[id] tells whether the id is currently on the canvas
+    vector<Block> blocks;
+    vector<char> live;
+    // pixels as of the last flush, read through canvas()
+    Canvas clr;
+    double opsScore;
+    vector<Block> coloredBlocks;
+    // distance of every pixel of clr to the target, and their sum
+    const Canvas* target = nullptr;
+    vector<ll> dist;
+    ll pixelScore;
+    // swaps whose pixels have not been moved yet, in order. A swap only retags
+    // the two blocks; pixels move when the canvas or score is read or a color
+    // lands on a queued rect.
+    vector<pair<Block, Block>> pendingSwaps;
+
+    // Undo journal, only recorded while a mark is open. A block entry holds the
+    // previous value of blocks[id]/live[id]; a pixel entry (id == -1) holds the
+    // old pixels and distances of a rect at offset in saved*.
+    struct Undo {
+        BlockId id;
+        Block block;
+        char live;
+        size_t offset;
+    };
+    struct Mark {
+        size_t journal;
+        int lastBlockId;
+        double opsScore;
+        ll pixelScore;
+        size_t coloredBlocks;
+        vector<pair<Block, Block>> pendingSwaps;
+    };
+    vector<Undo> journal;
+    vector<Pixel> savedPixels;
+    vector<ll> savedDist;
+    vector<Mark> marks;
+
+    Costs costs;
+
+    Painter() {}
+    Painter(int n, int m, const vector<RawBlock>& rb, const Canvas& targetColors, const Costs& opCosts) {
+        cerr << "created painter with " << rb.size() << " initial blocks\n";
+        lastBlockId = rb.size() - 1;
+        costs = opCosts;
+        opsScore = 0;
+        N = n;
+        M = m;
+        clr = Canvas(n, m, Pixel{255, 255, 255, 255});
+        for (const auto& b : rb) {
+            Color c{b.r, b.g, b.b, b.a};
+            fillRect(clr, b.blY, b.blX, b.trY, b.trX, toPixel(c));
+            put(b.id, Block{b.blY, b.blX, b.trY, b.trX, c});
+        }
+        target = &targetColors;
+        dist.resize(n * m);
+        pixelScore = 0;
+        for (int i = 0; i < n; i++)
+            for (int j = 0; j < m; j++) {
+                dist[i * m + j] = pixelDist(clr[i][j], targetColors[i][j]);
+                pixelScore += dist[i * m + j];
+            }
+    }
+
+    const Block* find(BlockId i) const {
+        if (i < 0 || i >= (int)live.size() || !live[i])
+            return nullptr;
+        return &blocks[i];
+    }
+
+    void put(BlockId i, const Block& b) {
+        if (i >= (int)live.size()) {
+            int sz = max(i + 1, 2 * (int)live.size());
+            blocks.resize(sz);
+            live.resize(sz, 0);
+        }
+        saveBlock(i);
+        blocks[i] = b;
+        live[i] = 1;
+    }
+
+    void erase(BlockId i) {
+        saveBlock(i);
+        live[i] = 0;
+    }
+
+    void saveBlock(BlockId i) {
+        if (!marks.empty())
+            journal.push_back(Undo{i, blocks[i], live[i], 0});
+    }
+
+    void saveRect(const Block& b) {
+        if (marks.empty())
+            return;
+        journal.push_back(Undo{-1, b, 0, savedPixels.size()});
+        for (int i = b.r1; i < b.r2; i++) {
+            savedPixels.insert(savedPixels.end(), clr[i] + b.c1, clr[i] + b.c2);
+            savedDist.insert(savedDist.end(), dist.begin() + i * M + b.c1, dist.begin() + i * M + b.c2);
+        }
+    }
+
+    // Checkpoints nest. rollback() undoes everything since the innermost mark in
+    // time proportional to what changed, release() keeps the changes and folds
+    // them into the enclosing mark.
+    void mark() {
+        marks.push_back(Mark{journal.size(), lastBlockId, opsScore, pixelScore,
+                             coloredBlocks.size(), pendingSwaps});
+    }
+
+    void rollback() {
+        Mark mk = std::move(marks.back());
+        marks.pop_back();
+        while (journal.size() > mk.journal) {
+            const Undo& u = journal.back();
+            if (u.id >= 0) {
+                blocks[u.id] = u.block;
+                live[u.id] = u.live;
+            } else {
+                const Block& b = u.block;
+                size_t k = u.offset, w = b.c2 - b.c1;
+                for (int i = b.r1; i < b.r2; i++, k += w) {
+                    copy(savedPixels.begin() + k, savedPixels.begin() + k + w, clr[i] + b.c1);
+                    copy(savedDist.begin() + k, savedDist.begin() + k + w, dist.begin() + i * M + b.c1);
+                }
+                savedPixels.resize(u.offset);
+                savedDist.resize(u.offset);
+            }
+            journal.pop_back();
+        }
+        lastBlockId = mk.lastBlockId;
+        opsScore = mk.opsScore;
+        pixelScore = mk.pixelScore;
+        coloredBlocks.resize(mk.coloredBlocks);
+        pendingSwaps = std::move(mk.pendingSwaps);
+    }
+
+    void release() {
+        marks.pop_back();
+        if (marks.empty()) {
+            journal.clear();
+            savedPixels.clear();
+            savedDist.clear();
+        }
+    }
+
+    static bool overlaps(const Block& a, const Block& b) {
+        return a.r1 < b.r2 && b.r1 < a.r2 && a.c1 < b.c2 && b.c1 < a.c2;
+    }
+
+    void rescore(const Block& b) {
+        for (int i = b.r1; i < b.r2; i++)
+            for (int j = b.c1; j < b.c2; j++) {
+                ll d = pixelDist(clr[i][j], (*target)[i][j]);
+                pixelScore += d - dist[i * M + j];
+                dist[i * M + j] = d;
+            }
+    }
+
+    void flushSwaps() {
+        for (const auto& [a, b] : pendingSwaps) {
+            saveRect(a);
+            saveRect(b);
+            swapRect(clr, a.r1, a.c1, b.r1, b.c1, a.r2 - a.r1, a.c2 - a.c1);
+            rescore(a);
+            rescore(b);
+        }
+        pendingSwaps.clear();
+    }
+
+    const Canvas& canvas() {
+        flushSwaps();
+        return clr;
+    }
+
+    bool doColor(BlockId i, Color c) {
+        const Block* pb = find(i);
+        if (!pb)
+            return false;
+        const auto& b = *pb;
+        opsScore += round(costs.color * N * M / ((b.r2 - b.r1) * (b.c2 - b.c1)));
+        for (const auto& [u, v] : pendingSwaps)
+            if (overlaps(u, b) || overlaps(v, b)) {
+                flushSwaps();
+                break;
+            }
+        Pixel p = toPixel(c);
+        saveRect(b);
+        fillRect(clr, b.r1, b.c1, b.r2, b.c2, p);
+        for (int i = b.r1; i < b.r2; i++)
+            for (int j = b.c1; j < b.c2; j++) {
+                ll d = pixelDist(p, (*target)[i][j]);
+                pixelScore += d - dist[i * M + j];
+                dist[i * M + j] = d;
+            }
+        coloredBlocks.push_back(b);
+        coloredBlocks.back().color = c;
+        return true;
+    }
+
+    bool doSplitX(BlockId i, int x) {
+        const Block* pb = find(i);
+        if (!pb)
+            return false;
+        const Block b = *pb;
+        if (x <= b.c1 || x >= b.c2) return false;
+        opsScore += round(costs.splitLine * N * M / ((b.r2 - b.r1) * (b.c2 - b.c1)));
+        Block left = b;
+        Block right = b;
+        erase(i);
+        left.c2 = x;
+        right.c1 = x;
+        put(blockIds.child(i, 0), left);
+        put(blockIds.child(i, 1), right);
+        return true;
+    }
+
+    bool doSplitY(BlockId i, int y) {
+        const Block* pb = find(i);
+        if (!pb)
+            return false;
+        const Block b = *pb;
+        if (y <= b.r1 || y >= b.r2) return false;
+        opsScore += round(costs.splitLine * N * M / ((b.r2 - b.r1) * (b.c2 - b.c1)));
+        Block down = b;
+        Block up = b;
+        erase(i);
+        down.r2 = y;
+        up.r1 = y;
+        put(blockIds.child(i, 0), down);
+        put(blockIds.child(i, 1), up);
+        return true;
+    }
+
+    bool doSplitPoint(BlockId i, int x, int y) {
+        const Block* pb = find(i);
+        if (!pb)
+            return false;
+        const Block b = *pb;
+        if (x <= b.c1 || x >= b.c2) return false;
+        if (y <= b.r1 || y >= b.r2) return false;
+        opsScore += round(costs.splitPoint * N * M / ((b.r2 - b.r1) * (b.c2 - b.c1)));
+        Block b0 = b;
+        Block b1 = b;
+        Block b2 = b;
+        Block b3 = b;
+        erase(i);
+        b0.r2 = y; b1.r2 = y;
+        b3.r1 = y; b2.r1 = y;
+        b3.c2 = x; b0.c2 = x;
+        b1.c1 = x; b2.c1 = x;
+        put(blockIds.child(i, 0), b0);
+        put(blockIds.child(i, 1), b1);
+        put(blockIds.child(i, 2), b2);
+        put(blockIds.child(i, 3), b3);
+        return true;
+    }
+
+    bool doMerge(BlockId i1, BlockId i2) {
+        const Block* pu = find(i1);
+        const Block* pv = find(i2);
+        if (!pu || !pv || i1 == i2)
+            return false;
+
+        const Block bu = *pu;
+        const Block bv = *pv;
+        opsScore += round(costs.merge * N * M / max((bu.r2 - bu.r1) * (bu.c2 - bu.c1),
+                                            (bv.r2 - bv.r1) * (bv.c2 - bv.c1)));
+        Block nb;
+        bool adjacent = false;
+        if (bu.r2 == bv.r1 || bu.r1 == bv.r2) {
+            if (bu.c1 == bv.c1 && bu.c2 == bv.c2) {
+                if (bu.r2 == bv.r1) {
+                    nb = bu;
+                    nb.r2 = bv.r2;
+                    adjacent = true;
+                } else {
+                    nb = bv;
+                    nb.r2 = bu.r2;
+                    adjacent = true;
+                }
+            } else {
+                return false;
+            }
+        }
+
+        if (bu.c2 == bv.c1 || bu.c1 == bv.c2) {
+            if (bu.r1 == bv.r1 && bu.r2 == bv.r2) {
+                if (bu.c2 == bv.c1) {
+                    nb = bu;
+                    nb.c2 = bv.c2;
+                    adjacent = true;
+                } else {
+                    nb = bv;
+                    nb.c2 = bu.c2;
+                    adjacent = true;
+                }
+            } else {
+                return false;
+            }
+        }
+
+        if (!adjacent)
+            return false;
+
+        erase(i1);
+        erase(i2);
+        lastBlockId++;
+        put(blockIds.root(lastBlockId), nb);
+        return true;
+    }
+
+    // The ids trade places: i1 takes bv's rect and keeps its own content.
+    bool doSwap(BlockId i1, BlockId i2) {
+        const Block* pu = find(i1);
+        const Block* pv = find(i2);
+        if (!pu || !pv || i1 == i2)
+            return false;
+
+        const Block bu = *pu;
+        const Block bv = *pv;
+        if (bu.r2 - bu.r1 != bv.r2 - bv.r1 || bu.c2 - bu.c1 != bv.c2 - bv.c1)
+            return false;
+        opsScore += round(costs.swap * N * M / max((bu.r2 - bu.r1) * (bu.c2 - bu.c1),
+                                                   (bv.r2 - bv.r1) * (bv.c2 - bv.c1)));
+
+        Block nu = bv, nv = bu;
+        nu.color = bu.color;
+        nv.color = bv.color;
+        put(i1, nu);
+        put(i2, nv);
+        auto same = [](const Block& a, const Block& b) {
+            return a.r1 == b.r1 && a.c1 == b.c1 && a.r2 == b.r2 && a.c2 == b.c2;
+        };
+        // swapping the same pair of rects back cancels the queued swap
+        if (!pendingSwaps.empty()) {
+            const auto& [a, b] = pendingSwaps.back();
+            if ((same(a, bu) && same(b, bv)) || (same(a, bv) && same(b, bu))) {
+                pendingSwaps.pop_back();
+                return true;
+            }
+        }
+        pendingSwaps.emplace_back(bu, bv);
+        return true;
+    }
+
+    bool doInstruction(const Instruction& ins) {
+        if (ins.type == tColor) {
+            return doColor(ins.id, ins.color);
+        } else if (ins.type == tSplitPoint) {
+            return doSplitPoint(ins.id, ins.x, ins.y);
+        } else if (ins.type == tSplitX) {
+            return doSplitX(ins.id, ins.x);
+        } else if (ins.type == tSplitY) {
+            return doSplitY(ins.id, ins.y);
+        } else if (ins.type == tMerge) {
+            return doMerge(ins.id, ins.oid);
+        } else if (ins.type == tSwap) {
+            return doSwap(ins.id, ins.oid);
+        } else return false;
+    }
+
+    double similarity() {
+        flushSwaps();
+        return pixelScore * kDistUnit * 0.005;
+    }
+
+    int totalScore() {
+        return round(similarity() + opsScore);
+    }
+};
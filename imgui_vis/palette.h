@@ -0,0 +1,178 @@
+#pragma once
+
+#include "canvas.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// The pixels of a region as distinct colors with multiplicities, so a fill
+// color search costs per color rather than per pixel on flat regions.
+// Pixels can be taken out again (add with times < 0), so a region that
+// changes a few cells at a time keeps its palette up to date cheaply. The
+// channel sums ride along, so the mean color needs no pass over the colors.
+struct Palette {
+    vector<Pixel> colors;
+    vector<int> counts; // may hold zeros for colors that left the region
+    int total = 0;
+    array<ll, 4> sum = {0, 0, 0, 0};
+
+    void clear() {
+        colors.clear();
+        counts.clear();
+        slots.clear();
+        total = 0;
+        sum = {0, 0, 0, 0};
+        zeros = 0;
+    }
+
+    void add(Pixel p, int times = 1) {
+        if (2 * (colors.size() + 1) > slots.size())
+            rehash(max<size_t>(16, 2 * slots.size()));
+        int& slot = find(keyOf(p));
+        if (slot == -1) {
+            slot = colors.size();
+            colors.push_back(p);
+            counts.push_back(0);
+            zeros++;
+        }
+        zeros -= counts[slot] == 0;
+        counts[slot] += times;
+        zeros += counts[slot] == 0;
+        total += times;
+        for (int k = 0; k < 4; k++)
+            sum[k] += (ll)p[k] * times;
+        if (zeros > 16 && 2 * zeros > (int)colors.size())
+            dropZeros();
+    }
+    void add(const Pixel* p, int len) {
+        for (int i = 0; i < len; i++)
+            add(p[i]);
+    }
+
+    // Puts back a palette saved as its colors and counts, in that order, so it
+    // prices exactly like the saved one.
+    void restore(vector<Pixel> c, vector<int> k) {
+        clear();
+        colors = move(c);
+        counts = move(k);
+        for (size_t i = 0; i < counts.size(); i++) {
+            total += counts[i];
+            zeros += counts[i] == 0;
+            for (int k = 0; k < 4; k++)
+                sum[k] += (ll)colors[i][k] * counts[i];
+        }
+        size_t cap = 16;
+        while (2 * (colors.size() + 1) > cap) cap *= 2;
+        if (!colors.empty()) rehash(cap);
+    }
+
+    // Sum over the region's pixels of the distance to c.
+    double dist(const Color& c) const { return distSum(colors.data(), counts.data(), colors.size(), toPixel(c)); }
+
+  private:
+    static uint32_t keyOf(const Pixel& p) {
+        uint32_t k;
+        memcpy(&k, p.data(), 4);
+        return k;
+    }
+
+    int& find(uint32_t key) {
+        size_t mask = slots.size() - 1;
+        size_t i = (key * 0x9e3779b1u) & mask;
+        while (slots[i] != -1 && keyOf(colors[slots[i]]) != key) i = (i + 1) & mask;
+        return slots[i];
+    }
+
+    void rehash(size_t cap) {
+        slots.assign(cap, -1);
+        for (size_t i = 0; i < colors.size(); i++)
+            find(keyOf(colors[i])) = i;
+    }
+
+    void dropZeros() {
+        size_t k = 0;
+        for (size_t i = 0; i < colors.size(); i++)
+            if (counts[i] != 0) {
+                colors[k] = colors[i];
+                counts[k++] = counts[i];
+            }
+        colors.resize(k);
+        counts.resize(k);
+        zeros = 0;
+        rehash(slots.size());
+    }
+
+    vector<int> slots;
+    int zeros = 0;
+};
+
+// The integer fill color that (locally) minimizes the summed distance to the
+// palette, i.e. its geometric median: up to 5 Weiszfeld steps from the
+// rounded mean, or from `from` when given, then +-1 moves per channel while
+// they help; a move that helps is repeated before its opposite is tried.
+// Sets *cost to the summed distance at the result. With a delta, works on the
+// palette as if delta (whose counts may be negative) had been added to it.
+inline Color bestFill(const Palette& pal, const Palette* delta, double* cost, const Color* from = nullptr) {
+    Color c = {0, 0, 0, 0};
+    const Palette* parts[2] = {&pal, delta};
+    int nparts = delta ? 2 : 1;
+    int total = pal.total + (delta ? delta->total : 0);
+    if (total == 0) {
+        if (cost) *cost = 0;
+        return c;
+    }
+    if (from) {
+        c = *from;
+    } else {
+        for (int k = 0; k < 4; k++) {
+            ll sum = pal.sum[k] + (delta ? delta->sum[k] : 0);
+            c[k] = (2 * sum + total) / (2 * total);
+        }
+    }
+    for (int rep = 0; rep < 5; rep++) {
+        array<double, 4> aux = {0, 0, 0, 0};
+        double sum_coeff = 0;
+        for (int p = 0; p < nparts; p++)
+            for (size_t i = 0; i < parts[p]->colors.size(); i++) {
+                auto& color = parts[p]->colors[i];
+                int sum_sq = 0;
+                for (int k = 0; k < 4; k++)
+                    sum_sq += sqr(color[k] - c[k]);
+                double coeff = parts[p]->counts[i] / max(1.0, sqrt(double(sum_sq)));
+                sum_coeff += coeff;
+                for (int k = 0; k < 4; k++)
+                    aux[k] += color[k] * coeff;
+            }
+        auto old = c;
+        for (int k = 0; k < 4; k++)
+            c[k] = llround(aux[k] / sum_coeff);
+        if (c == old) break;
+    }
+    auto dist = [&](const Color& c) { return pal.dist(c) + (delta ? delta->dist(c) : 0); };
+    double diff = dist(c);
+    while (true) {
+        bool changed = false;
+        for (int k = 0; k < 4; k++) {
+            for (int d = -1; d <= 1; d += 2) {
+                bool moved = false;
+                while (true) {
+                    c[k] += d;
+                    double new_diff = dist(c);
+                    if (new_diff >= diff) {
+                        c[k] -= d;
+                        break;
+                    }
+                    diff = new_diff;
+                    moved = changed = true;
+                }
+                if (moved) break;
+            }
+        }
+        if (!changed) break;
+    }
+    if (cost) *cost = diff;
+    return c;
+}
+
+inline Color bestFill(const Palette& pal, double* cost = nullptr) { return bestFill(pal, nullptr, cost); }
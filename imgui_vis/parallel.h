@@ -0,0 +1,28 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Runs f(i) for every i in [0, n) on up to `threads` workers (all cores if 0).
+// Workers pull the next index from a shared counter, so uneven items balance.
+template <class F>
+void parallelFor(int n, F&& f, int threads = 0) {
+    if (threads <= 0)
+        threads = max(1u, thread::hardware_concurrency());
+    threads = min(threads, n);
+    if (threads <= 1) {
+        for (int i = 0; i < n; i++)
+            f(i);
+        return;
+    }
+    atomic<int> next{0};
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back([&] {
+            for (int i; (i = next.fetch_add(1)) < n;)
+                f(i);
+        });
+    for (auto& w : workers)
+        w.join();
+}
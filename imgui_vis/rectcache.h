@@ -0,0 +1,196 @@
+#pragma once
+
+#include "canvas.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Per-test table of rectangle fill results that outlives a run: for a pixel
+// rect and a way of picking its color, the color and the pixel penalty
+// (sum of distances * 5, i.e. thousandths of a point), or only a lower bound
+// on it when the scan that produced it was cut short.
+// Rects are stored in the coordinates of the unrotated target, so every
+// direction of a solver shares entries. The table is a fixed-size open
+// addressing hash in a shared file mapping; lookups and inserts are lock-free
+// and safe from any number of threads. A full table just stops taking inserts.
+enum RectFill : uint8_t {
+    kFillMean = 1, // per-channel rounded mean
+};
+
+class RectCache {
+  public:
+    static constexpr int kLogCapacity = 21; // 2M entries, 32MB sparse file
+    static constexpr int kMaxProbes = 32;
+
+    RectCache() {}
+    RectCache(const RectCache&) = delete;
+    RectCache& operator=(const RectCache&) = delete;
+    ~RectCache() { close(); }
+
+    static string pathFor(const string& inputPath) {
+        return filesystem::path(inputPath).replace_extension(".rects").string();
+    }
+
+    // FNV-1a over the pixels, to tell pictures apart.
+    static uint64_t fingerprint(const Canvas& cv) {
+        uint64_t h = 1469598103934665603ull;
+        const unsigned char* p = (const unsigned char*)cv.data;
+        for (size_t i = 0; i < cv.bytes(); i++)
+            h = (h ^ p[i]) * 1099511628211ull;
+        return h;
+    }
+
+    // Attaches to the cache for `target`, starting a fresh one if the file is
+    // missing or was built for another picture. Falls back to memory only if
+    // the file cannot be mapped.
+    void open(const string& fname, const Canvas& target) {
+        close();
+        n = target.n;
+        m = target.m;
+        size_t size = sizeof(Header) + sizeof(Entry) * (size_t(1) << kLogCapacity);
+        Header want{};
+        memcpy(want.magic, kMagic, 8);
+        want.n = n;
+        want.m = m;
+        want.fingerprint = fingerprint(target);
+#ifndef _WIN32
+        int fd = ::open(fname.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd >= 0) {
+            struct stat st;
+            Header h{};
+            bool ok = fstat(fd, &st) == 0;
+            bool valid = ok && st.st_size == (off_t)size && pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+                         memcmp(&h, &want, sizeof(h)) == 0;
+            // truncating keeps a fresh table sparse on disk
+            if (ok && !valid)
+                ok = ftruncate(fd, 0) == 0 && ftruncate(fd, size) == 0;
+            void* p = ok ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (p != MAP_FAILED) {
+                base = (char*)p;
+                mapped = size;
+            }
+        }
+#endif
+        if (!base) {
+            cerr << "Rect cache " << fname << " is not persistent\n";
+            base = (char*)calloc(size, 1);
+        }
+        memcpy(base, &want, sizeof(want));
+        entries = (Entry*)(base + sizeof(Header));
+    }
+
+    void close() {
+        if (!base) return;
+#ifndef _WIN32
+        if (mapped) munmap(base, mapped);
+        else free(base);
+#else
+        free(base);
+#endif
+        base = nullptr;
+        entries = nullptr;
+        mapped = 0;
+    }
+
+    bool isOpen() const { return entries != nullptr; }
+
+    // Rows [r1, r2) and columns [c1, c2) of the target turned `rot` times
+    // clockwise. Returns false on a miss; exact is false for a lower bound.
+    bool find(RectFill fill, int rot, int r1, int c1, int r2, int c2, Pixel& color, int64_t& penalty,
+              bool& exact) const {
+        if (!entries) return false;
+        uint64_t k = key(fill, rot, r1, c1, r2, c2);
+        for (uint64_t i = slot(k), probe = 0; probe < kMaxProbes; i = (i + 1) & kMask, probe++) {
+            uint64_t ek = entries[i].key.load(memory_order_acquire);
+            if (ek == 0) return false;
+            if (ek != k) continue;
+            uint64_t v = entries[i].value.load(memory_order_acquire);
+            if (v == 0) return false; // claimed, value not stored yet
+            uint32_t c = uint32_t(v >> 32);
+            memcpy(color.data(), &c, 4);
+            penalty = int64_t(v & kPenaltyMask) - 1;
+            exact = !(v & kBoundFlag);
+            return true;
+        }
+        return false;
+    }
+
+    // A bound never replaces an exact value or a higher bound.
+    void insert(RectFill fill, int rot, int r1, int c1, int r2, int c2, Pixel color, int64_t penalty,
+                bool exact = true) {
+        if (!entries || penalty < 0 || penalty >= (int64_t)kPenaltyMask) return;
+        uint64_t k = key(fill, rot, r1, c1, r2, c2);
+        uint32_t c;
+        memcpy(&c, color.data(), 4);
+        uint64_t v = (uint64_t(c) << 32) | uint64_t(penalty + 1) | (exact ? 0 : kBoundFlag);
+        for (uint64_t i = slot(k), probe = 0; probe < kMaxProbes; i = (i + 1) & kMask, probe++) {
+            uint64_t ek = 0;
+            if (entries[i].key.compare_exchange_strong(ek, k, memory_order_acq_rel) || ek == k) {
+                uint64_t old = entries[i].value.load(memory_order_acquire);
+                while ((old == 0 || ((old & kBoundFlag) && (exact || (old & kPenaltyMask) < (v & kPenaltyMask)))) &&
+                       !entries[i].value.compare_exchange_weak(old, v, memory_order_acq_rel)) {
+                }
+                return;
+            }
+        }
+    }
+
+  private:
+    static constexpr char kMagic[8] = {'I', 'C', 'P', 'R', 'E', 'C', '0', '1'};
+    static constexpr uint64_t kMask = (uint64_t(1) << kLogCapacity) - 1;
+    static constexpr uint64_t kBoundFlag = uint64_t(1) << 31;
+    static constexpr uint64_t kPenaltyMask = kBoundFlag - 1;
+
+    struct Header {
+        char magic[8];
+        int32_t n, m;
+        uint64_t fingerprint;
+        char pad[8];
+    };
+    // key: fill in bits 48.., then r1 c1 r2 c2 in 12 bits each; 0 = empty.
+    // value: color in the high half, penalty + 1 in the low 31 bits, bit 31
+    // set for a lower bound; 0 = unset.
+    struct Entry {
+        atomic<uint64_t> key;
+        atomic<uint64_t> value;
+    };
+    static_assert(atomic<uint64_t>::is_always_lock_free, "entries live in a file mapping");
+    static_assert(sizeof(Entry) == 16, "entries live in a file mapping");
+
+    // Undoes `rot` clockwise turns: a rect of a picture turned once, with
+    // width w, is rows [w - c2, w - c1) and columns [r1, r2) of the original.
+    uint64_t key(RectFill fill, int rot, int r1, int c1, int r2, int c2) const {
+        int w = rot % 2 ? n : m;
+        for (int t = 0; t < rot; t++) {
+            int nr1 = w - c2, nr2 = w - c1;
+            c1 = r1;
+            c2 = r2;
+            r1 = nr1;
+            r2 = nr2;
+            w = w == m ? n : m;
+        }
+        return (uint64_t(fill) << 48) | (uint64_t(r1) << 36) | (uint64_t(c1) << 24) | (uint64_t(r2) << 12) | uint64_t(c2);
+    }
+
+    static uint64_t slot(uint64_t k) {
+        k ^= k >> 31;
+        k *= 0x7fb5d329728ea185ull;
+        k ^= k >> 27;
+        return k & kMask;
+    }
+
+    int n = 0, m = 0;
+    char* base = nullptr;
+    size_t mapped = 0;
+    Entry* entries = nullptr;
+};
@@ -1,118 +1,30 @@
 #pragma once
 
 #include "common.h"
-
+#include "corners.h"
+#include "io.h"
+#include "painter.h"
+#include "palette.h"
+#include "parallel.h"
+#include "rectcache.h"
+#include "telemetry.h"
+
+#include <climits>
+#include <condition_variable>
 #include <iomanip>
-
-constexpr int tColor = 1;
-constexpr int tSplitPoint = 2;
-constexpr int tSplitX = 3;
-constexpr int tSplitY = 4;
-constexpr int tMerge = 5;
-constexpr int tSwap = 6;
-
-struct RawBlock {
-    string id;
-    int blX, blY, trX, trY;
-    int r, g, b, a;
-};
-
-struct Block {
-    int r1, c1, r2, c2;
-    Color color;
-};
-
-struct Costs {
-    double splitLine, splitPoint, color, swap, merge;
-};
+#include <map>
+#include <memory>
+#include <mutex>
 
 int N, M;
-vector<vector<Color>> colors, initialColors;
+Canvas colors, initialColors;
 vector<RawBlock> rawBlocks;
 vector<Block> coloredBlocks;
 Costs costs;
 bool running;
-
-struct Input {
-    int N, M;
-    vector<vector<Color>> colors, initialColors;
-    vector<RawBlock> rawBlocks;
-    Costs costs;
-};
-
-struct Instruction {
-    string id, oid;
-    int type;
-    int x, y;
-    Color color;
-
-    string text() const {
-        char buf[128];
-        if (type == tColor) {
-            sprintf(buf, "color [%s] [%d, %d, %d, %d]", id.c_str(), color[0], color[1], color[2], color[3]);
-        } else if (type == tSplitPoint) {
-            sprintf(buf, "cut [%s] [%d, %d]", id.c_str(), x, y);
-        } else if (type == tSplitX) {
-            sprintf(buf, "cut [%s] [X] [%d]", id.c_str(), x);
-        } else if (type == tSplitY) {
-            sprintf(buf, "cut [%s] [Y] [%d]", id.c_str(), y);
-        } else if (type == tMerge) {
-            sprintf(buf, "merge [%s] [%s]", id.c_str(), oid.c_str());
-        } else if (type == tSwap) {
-            sprintf(buf, "swap [%s] [%s]", id.c_str(), oid.c_str());
-        } else assert(false);
-        return buf;
-    }
-};
-
-Instruction ColorIns(const string& i, Color c) {
-    Instruction res;
-    res.type = tColor;
-    res.id = i;
-    res.color = c;
-    return res;
-}
-
-Instruction SplitPointIns(const string& i, int x, int y) {
-    Instruction res;
-    res.type = tSplitPoint;
-    res.id = i;
-    res.x = x;
-    res.y = y;
-    return res;
-}
-
-Instruction SplitXIns(const string& i, int x) {
-    Instruction res;
-    res.type = tSplitX;
-    res.id = i;
-    res.x = x;
-    return res;
-}
-
-Instruction SplitYIns(const string& i, int y) {
-    Instruction res;
-    res.type = tSplitY;
-    res.id = i;
-    res.y = y;
-    return res;
-}
-
-Instruction MergeIns(const string& i1, string i2) {
-    Instruction res;
-    res.type = tMerge;
-    res.id = i1;
-    res.oid = i2;
-    return res;
-}
-
-Instruction SwapIns(const string& i1, const string& i2) {
-    Instruction res;
-    res.type = tSwap;
-    res.id = i1;
-    res.oid = i2;
-    return res;
-}
+// Of the current test. Loading a test swaps in a new one; a solver keeps the
+// one it started with, which stays mapped until the last solver drops it.
+shared_ptr<RectCache> rectCache = make_shared<RectCache>();
 
 struct Solution {
     double score;
@@ -120,6 +32,10 @@ struct Solution {
 
     void rotateClockwise() {
       int last_cut = -1;
+      auto prevIndex = [](BlockId& id) {
+        int k = blockIds.index(id);
+        id = blockIds.sibling(id, k == 0 ? 3 : k - 1);
+      };
       for (auto& i : ins) {
         if (i.type == tSplitX) {
           last_cut = i.type;
@@ -141,238 +57,28 @@ struct Solution {
         }
         if (i.type == tColor) {
           if (last_cut == tSplitX) {
-            i.id.back() ^= 1;
+            i.id = blockIds.sibling(i.id, blockIds.index(i.id) ^ 1);
           }
           if (last_cut == tSplitPoint) {
-            if (i.id.back() == '0') {
-              i.id.back() = '3';
-            } else {
-              i.id.back() -= 1;
-            }
+            prevIndex(i.id);
           }
           continue;
         }
         if (i.type == tMerge) {
-          if (last_cut == tSplitPoint && i.id.find('.') != string::npos) {
-            if (i.id.back() == '0') {
-              i.id.back() = '3';
-            } else {
-              i.id.back() -= 1;
-            }
-            if (i.oid.back() == '0') {
-              i.oid.back() = '3';
-            } else {
-              i.oid.back() -= 1;
-            }
+          if (last_cut == tSplitPoint && !blockIds.isRoot(i.id)) {
+            prevIndex(i.id);
+            prevIndex(i.oid);
           }
         }
       }
     }
 };
 
-struct Painter {
-    int lastBlockId;
-    int N, M;
-    unordered_map<string, Block> blocks;
-    vector<vector<Color>> clr;
-    double opsScore;
-    vector<Block> coloredBlocks;
-
-    Painter() {}
-    Painter(int n, int m, const vector<RawBlock>& rb) {
-        cerr << "created painter with " << rb.size() << " initial blocks\n";
-        lastBlockId = rb.size() - 1;
-        opsScore = 0;
-        N = n;
-        M = m;
-        Color c;
-        c[0] = c[1] = c[2] = c[3] = 255;
-        clr.assign(n, vector<Color>(m, c));
-        for (const auto& b : rb) {
-            c[0] = b.r; c[1] = b.g; c[2] = b.b; c[3] = b.a;
-            for (int x = b.blX; x < b.trX; x++)
-                for (int y = b.blY; y < b.trY; y++)
-                    clr[y][x] = c;
-            blocks[b.id] = Block{b.blY, b.blX, b.trY, b.trX, c};
-        }
-    }
-
-    bool doColor(const string& i, Color c) {
-        if (blocks.find(i) == blocks.end())
-            return false;
-        const auto& b = blocks[i];
-        opsScore += round(costs.color * N * M / ((b.r2 - b.r1) * (b.c2 - b.c1)));
-        for (int i = b.r1; i < b.r2; i++)
-            for (int j = b.c1; j < b.c2; j++)
-                clr[i][j] = c;
-        coloredBlocks.push_back(b);
-        coloredBlocks.back().color = c;
-        return true;
-    }
-
-    bool doSplitX(const string& i, int x) {
-        // cerr << "doSplitX " << i << " " << x << endl;
-        if (blocks.find(i) == blocks.end())
-            return false;
-        const auto& b = blocks[i];
-        // cerr << "this block is " << b.r1 << "," << b.c1 << " - " << b.r2 << "," << b.c2 << endl;
-        if (x <= b.c1 || x >= b.c2) return false;
-        opsScore += round(costs.splitLine * N * M / ((b.r2 - b.r1) * (b.c2 - b.c1)));
-        Block left = b;
-        Block right = b;
-        blocks.erase(blocks.find(i));
-        left.c2 = x;
-        right.c1 = x;
-        blocks[i + ".0"] = left;
-        blocks[i + ".1"] = right;
-        return true;
-    }
-
-    bool doSplitY(const string& i, int y) {
-        // cerr << "doSplitY " << i << " " << y << endl;
-        if (blocks.find(i) == blocks.end())
-            return false;
-        const auto& b = blocks[i];
-        // cerr << "this block is " << b.r1 << "," << b.c1 << " - " << b.r2 << "," << b.c2 << endl;
-        if (y <= b.r1 || y >= b.r2) return false;
-        opsScore += round(costs.splitLine * N * M / ((b.r2 - b.r1) * (b.c2 - b.c1)));
-        Block down = b;
-        Block up = b;
-        blocks.erase(blocks.find(i));
-        down.r2 = y;
-        up.r1 = y;
-        blocks[i + ".0"] = down;
-        blocks[i + ".1"] = up;
-        // cerr << "new blocks: " << i + ".0" << " " << i + ".1" << endl;
-        return true;
-    }
-
-    bool doSplitPoint(const string& i, int x, int y) {
-        if (blocks.find(i) == blocks.end())
-            return false;
-        const auto& b = blocks[i];
-        if (x <= b.c1 || x >= b.c2) return false;
-        if (y <= b.r1 || y >= b.r2) return false;
-        opsScore += round(costs.splitPoint * N * M / ((b.r2 - b.r1) * (b.c2 - b.c1)));
-        Block b0 = b;
-        Block b1 = b;
-        Block b2 = b;
-        Block b3 = b;
-        blocks.erase(blocks.find(i));
-        b0.r2 = y; b1.r2 = y;
-        b3.r1 = y; b2.r1 = y;
-        b3.c2 = x; b0.c2 = x;
-        b1.c1 = x; b2.c1 = x;
-        blocks[i + ".0"] = b0;
-        blocks[i + ".1"] = b1;
-        blocks[i + ".2"] = b2;
-        blocks[i + ".3"] = b3;
-        return true;
-    }
-
-    bool doMerge(const string& i1, const string& i2) {
-        // cerr << "doMerge " << i1 << " " << i2 << endl;
-        if (blocks.find(i1) == blocks.end() || blocks.find(i2) == blocks.end())
-            return false;
-
-        const auto& bu = blocks[i1];
-        const auto& bv = blocks[i2];
-        // cerr << bu.r1 << "," << bu.c1 << " - " << bu.r2 << "," << bu.c2 << endl;
-        // cerr << bv.r1 << "," << bv.c1 << " - " << bv.r2 << "," << bv.c2 << endl;
-        opsScore += round(costs.merge * N * M / max((bu.r2 - bu.r1) * (bu.c2 - bu.c1),
-                                            (bv.r2 - bv.r1) * (bv.c2 - bv.c1)));
-        Block nb;
-        if (bu.r2 == bv.r1 || bu.r1 == bv.r2) {
-            if (bu.c1 == bv.c1 && bu.c2 == bv.c2) {
-                if (bu.r2 == bv.r1) {
-                    nb = bu;
-                    nb.r2 = bv.r2;
-                } else {
-                    nb = bv;
-                    nb.r2 = bu.r2;
-                }
-            } else {
-                return false;
-            }
-        }
-
-        if (bu.c2 == bv.c1 || bu.c1 == bv.c2) {
-            if (bu.r1 == bv.r1 && bu.r2 == bv.r2) {
-                if (bu.c2 == bv.c1) {
-                    nb = bu;
-                    nb.c2 = bv.c2;
-                } else {
-                    nb = bv;
-                    nb.c2 = bu.c2;
-                }
-            } else {
-                return false;
-            }
-        }
-
-        blocks.erase(blocks.find(i1));
-        blocks.erase(blocks.find(i2));
-        lastBlockId++;
-        blocks[to_string(lastBlockId)] = nb;
-        // cerr << "new block: " << lastBlockId << endl;
-        return true;
-    }
-
-    bool doSwap(const string& i1, const string& i2) {
-        return true;
-        if (blocks.find(i1) == blocks.end() || blocks.find(i2) == blocks.end())
-            return false;
-
-        const auto& bu = blocks[i1];
-        const auto& bv = blocks[i2];
-        if (bu.r2 - bu.r1 != bv.r2 - bv.r1 || bu.c2 - bu.c1 != bv.c2 - bv.c1)
-            return false;
-        opsScore += round(costs.swap * N * M / max((bu.r2 - bu.r1) * (bu.c2 - bu.c1),
-                                                   (bv.r2 - bv.r1) * (bv.c2 - bv.c1)));
-        
-        for (int i = 0; i < bu.r2 - bu.r1; i++)
-            for (int j = 0; j < bu.c2 - bu.c1; j++)
-                swap(clr[bu.r1 + i][bu.c1 + j], clr[bv.r1 + i][bv.c1 + j]);
-        return true;
-    }
-
-    bool doInstruction(const Instruction& ins) {
-        if (ins.type == tColor) {
-            return doColor(ins.id, ins.color);
-        } else if (ins.type == tSplitPoint) {
-            return doSplitPoint(ins.id, ins.x, ins.y);
-        } else if (ins.type == tSplitX) {
-            return doSplitX(ins.id, ins.x);
-        } else if (ins.type == tSplitY) {
-            return doSplitY(ins.id, ins.y);
-        } else if (ins.type == tMerge) {
-            return doMerge(ins.id, ins.oid);
-        } else if (ins.type == tSwap) {
-            return doSwap(ins.id, ins.oid);
-        } else return false;
-    }
-
-    int totalScore(const vector<vector<Color>>& targetColors) const {
-        double res = 0;
-        // cerr << "opsScore = " << opsScore << endl;
-        // cerr << clr.size() << " " << targetColors.size() << endl;
-        for (int i = 0; i < N; i++)
-            for (int j = 0; j < M; j++) {
-                double d = 0;
-                for (int q = 0; q < 4; q++)
-                    d += sqr(clr[i][j][q] - targetColors[i][j][q]);
-                res += sqrt(d);
-            }
-        return round(res * 0.005 + opsScore);
-    }
-};
 
 void postprocess(Solution& res);
 
 int totalNodes;
 int visitedNodes;
-unordered_map<ll, double> mg;
-double f[410][410];
 
 double colorCost(int a, int b) {
     return round(costs.color * N * M / (a * b));
@@ -394,122 +100,75 @@ double opsCost(int r, int c) {
     // can check second order lul
 }
 
-double getG(int r1, int c1, int r2, int c2) {
-    if (r1 == N || c1 == M) return 0;
-    ll key = ((r1 * M + c1) * ll(N) + r2) * ll(M) + c2;
-    if (mg.find(key) != mg.end()) {
-        return mg[key];
-    }
-
-    double res = 1e9;
-    double oc = opsCost(r1, c1);
-    if (r2 == N) {
-        Color sum;
-        for (int q = 0; q < 4; q++) sum[q] = 0;
-        int total = 0;
-
-        for (int r = r1; r < r2; r++) {
-            for (int c = c1; c < c2; c++) {
-                for (int q = 0; q < 4; q++) sum[q] += colors[r][c][q];
-                total++;
-            }
-
-            if ((r + 1) % S == 0) {
-                Color avg;
-                for (int q = 0; q < 4; q++)
-                    avg[q] = sum[q] / total;
-                double colorPenalty = 0;
-                double cur = oc + getG(r + 1, c1, N, c2);
-                for (int qr = r1; qr <= r; qr++)
-                    for (int c = c1; c < c2; c++) {
-                        double ssq = 0;
-                        for (int q = 0; q < 4; q++)
-                            ssq += sqr(avg[q] - colors[qr][c][q]);
-                        colorPenalty += sqrt(ssq);
-                        // if (cur + colorPenalty * 0.005 > res) {
-                        //     break;
-                        // }
-                    }
-                cur += colorPenalty * 0.005;
-                if (cur < res) {
-                    res = cur;
-                    // store answer
-                }
-            }
-        }
-    }
-    if (c2 == M) {
-        Color sum;
-        for (int q = 0; q < 4; q++) sum[q] = 0;
-        int total = 0;
-
-        for (int c = c1; c < c2; c++) {
-            for (int r = r1; r < r2; r++) {
-                for (int q = 0; q < 4; q++) sum[q] += colors[r][c][q];
-                total++;
-            }
-
-            if ((c + 1) % S == 0) {
-                Color avg;
-                for (int q = 0; q < 4; q++)
-                    avg[q] = sum[q] / total;
-                double colorPenalty = 0;
-                double cur = oc + getG(r1, c + 1, r2, M);
-                for (int r = r1; r < r2; r++)
-                    for (int qc = c1; qc <= c; qc++) {
-                        double ssq = 0;
-                        for (int q = 0; q < 4; q++)
-                            ssq += sqr(avg[q] - colors[r][qc][q]);
-                        colorPenalty += sqrt(ssq);
-                        // if (cur + colorPenalty * 0.005 > res) {
-                        //     break;
-                        // }
-                    }
-                cur += colorPenalty * 0.005;
-                if (cur < res) {
-                    res = cur;
-                    // store answer
-                }
-            }
-        }
+// Value per pair of grid intervals [xa, xb) x [ya, yb), sized for one run.
+// Intervals are numbered by start and then end, so the cuts of an interval
+// [a, b) at a + 1.. read consecutive numbers.
+struct IntervalTable {
+    int n = 0, m = 0;
+    size_t cntY = 0;
+    vector<int> idX, idY; // idX[a * (n + 1) + b] = number of [a, b)
+    vector<int> cell;
+
+    IntervalTable(int n, int m) : n(n), m(m) {
+        auto number = [](int k, vector<int>& id) {
+            id.assign((k + 1) * (k + 1), -1);
+            int cnt = 0;
+            for (int a = 0; a < k; a++)
+                for (int b = a + 1; b <= k; b++)
+                    id[a * (k + 1) + b] = cnt++;
+            return cnt;
+        };
+        size_t cntX = number(n, idX);
+        cntY = number(m, idY);
+        cell.assign(cntX * cntY, 0);
+    }
+
+    int& at(int xa, int xb, int ya, int yb) {
+        return cell[idX[xa * (n + 1) + xb] * cntY + idY[ya * (m + 1) + yb]];
     }
+};
 
-
-    return mg[key] = res;
-}
-
-void solveDP2() {
-    if (N % S != 0) {
-        cerr << "N % S != 0\n";
-        return;
+// Lattice lines 0 = l[0] < .. < l.back() = cv.n for the rows of cv. Picks up
+// to k cuts at the strongest color edges between consecutive rows, keeping
+// them len / 2k apart so one busy band cannot take the whole budget; what is
+// left of the budget halves the widest gaps.
+vector<int> cutLines(const Canvas& cv, int k) {
+    int len = cv.n;
+    k = min(k, len - 1);
+    vector<double> edge(len, 0);
+    vector<int> order;
+    for (int i = 1; i < len; i++) {
+      edge[i] = distSum(cv[i - 1], cv[i], cv.m);
+      order.push_back(i);
+    }
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return edge[a] > edge[b]; });
+    int gap = max(1, len / (2 * max(k, 1)));
+    set<int> lines = {0, len};
+    for (int i : order) {
+      if ((int) lines.size() - 2 >= k || edge[i] <= 0) {
+        break;
+      }
+      auto it = lines.lower_bound(i);
+      if (*it - i >= gap && i - *prev(it) >= gap) {
+        lines.insert(i);
+      }
     }
-    auto start_time = Time::now();
-    auto GetTime = [&]() {
-      auto cur_time = Time::now();
-      std::chrono::duration<double> fs = cur_time - start_time;
-      return std::chrono::duration_cast<chrono_ms>(fs).count() * 0.001;
-    };
-    mg.clear();
-    memset(f, 0, sizeof(f));
-    for (int r = N - S; r >= 0; r -= S) {
-        msg.clear() << "Running on row " << r << "...\n";
-        cerr << r << " " << GetTime() << "s\n";
-        for (int c = M - S; c >= 0; c -= S) {
-            f[r][c] = 1e9;
-            for (int c2 = c + S; c2 <= M; c2 += S) {
-                f[r][c] = min(f[r][c], f[r][c2] + getG(r, c, N, c2));
-            }
-            for (int r2 = r + S; r2 <= N; r2 += S) {
-                f[r][c] = min(f[r][c], f[r2][c] + getG(r, c, r2, M));
-            }
+    while ((int) lines.size() - 2 < k) {
+      int best = 0, widest = 0;
+      for (auto it = next(lines.begin()); it != lines.end(); it++) {
+        if (*it - *prev(it) > widest) {
+          widest = *it - *prev(it);
+          best = *prev(it) + widest / 2;
         }
+      }
+      if (widest < 2) {
+        break;
+      }
+      lines.insert(best);
     }
-    msg.clear() << "Result: " << f[0][0] << "\n";
+    return vector<int>(lines.begin(), lines.end());
 }
 
-int dp[20100][20100];
-int aux[201][201];
-
 int mode = 0;
 
 vector<pair<int, int>> dp_corners;
@@ -524,7 +183,7 @@ pair<Solution, int> getTwoStepMerge(int blocksPerSide, int blockSize, int lines)
         int prevBlockId = bid;
         bid++;
         for (int j = 1; j < blocksPerSide; j++) {
-            res.ins.push_back(MergeIns(to_string(prevBlockId), to_string(bid)));
+            res.ins.push_back(MergeIns(blockIds.root(prevBlockId), blockIds.root(bid)));
             res.score += mergeCost(blockSize, blockSize * j, blockSize);
             prevBlockId = nextBlockId;
             nextBlockId++;
@@ -534,38 +193,38 @@ pair<Solution, int> getTwoStepMerge(int blocksPerSide, int blockSize, int lines)
     }
     int prevBlockId = vertBlocks[0];
     for (size_t i = 1; i < vertBlocks.size(); i++) {
-        res.ins.push_back(MergeIns(to_string(prevBlockId), to_string(vertBlocks[i])));
+        res.ins.push_back(MergeIns(blockIds.root(prevBlockId), blockIds.root(vertBlocks[i])));
         res.score += mergeCost(N, blockSize * i, blockSize);
         prevBlockId = nextBlockId;
         nextBlockId++;
     }
 
-    string curId = to_string(nextBlockId - 1);
-    vector<string> horIds;
+    BlockId curId = blockIds.root(nextBlockId - 1);
+    vector<BlockId> horIds;
     for (int i = 1; i < blocksPerSide; i++) {
         res.ins.push_back(SplitYIns(curId, i * N / blocksPerSide));
         res.score += splitLineCost(lines * blockSize, (blocksPerSide - i + 1) * blockSize);
-        horIds.push_back(curId + ".0");
-        curId += ".1";
+        horIds.push_back(blockIds.child(curId, 0));
+        curId = blockIds.child(curId, 1);
     }
     horIds.push_back(curId);
     assert((int)horIds.size() == blocksPerSide);
 
     for (int i = lines; i < blocksPerSide; i++) {
         for (int j = 0; j < blocksPerSide; j++) {
-            res.ins.push_back(MergeIns(horIds[j], to_string(bid)));
+            res.ins.push_back(MergeIns(horIds[j], blockIds.root(bid)));
             res.score += mergeCost(blockSize, blockSize * i, blockSize);
-            horIds[j] = to_string(nextBlockId);
+            horIds[j] = blockIds.root(nextBlockId);
             nextBlockId++;
             bid++;
         }
     }
 
-    string prevHorId = horIds[0];
+    BlockId prevHorId = horIds[0];
     for (int i = 1; i < blocksPerSide; i++) {
         res.ins.push_back(MergeIns(horIds[i], prevHorId));
         res.score += mergeCost(N, blockSize * i, blockSize);
-        prevHorId = to_string(nextBlockId);
+        prevHorId = blockIds.root(nextBlockId);
         nextBlockId++;
     }
 
@@ -582,7 +241,7 @@ pair<Solution, int> getThreeStepMerge(int blocksPerSide, int blockSize, int line
         int prevBlockId = bid;
         bid++;
         for (int j = 1; j < blocksPerSide; j++) {
-            res.ins.push_back(MergeIns(to_string(prevBlockId), to_string(bid)));
+            res.ins.push_back(MergeIns(blockIds.root(prevBlockId), blockIds.root(bid)));
             res.score += mergeCost(blockSize, blockSize * j, blockSize);
             prevBlockId = nextBlockId;
             nextBlockId++;
@@ -592,19 +251,19 @@ pair<Solution, int> getThreeStepMerge(int blocksPerSide, int blockSize, int line
     }
     int prevBlockId = vertBlocks[0];
     for (size_t i = 1; i < vertBlocks.size(); i++) {
-        res.ins.push_back(MergeIns(to_string(prevBlockId), to_string(vertBlocks[i])));
+        res.ins.push_back(MergeIns(blockIds.root(prevBlockId), blockIds.root(vertBlocks[i])));
         res.score += mergeCost(N, blockSize * i, blockSize);
         prevBlockId = nextBlockId;
         nextBlockId++;
     }
 
-    string curId = to_string(nextBlockId - 1);
-    vector<string> horIds;
+    BlockId curId = blockIds.root(nextBlockId - 1);
+    vector<BlockId> horIds;
     for (int i = 1; i <= lines2; i++) {
         res.ins.push_back(SplitYIns(curId, i * N / blocksPerSide));
         res.score += splitLineCost(lines1 * blockSize, (blocksPerSide - i + 1) * blockSize);
-        horIds.push_back(curId + ".0");
-        curId += ".1";
+        horIds.push_back(blockIds.child(curId, 0));
+        curId = blockIds.child(curId, 1);
     }
     auto rest1 = curId;
     assert((int)horIds.size() == lines2);
@@ -612,46 +271,46 @@ pair<Solution, int> getThreeStepMerge(int blocksPerSide, int blockSize, int line
     for (int i = lines1; i < blocksPerSide; i++) {
         for (int j = 0; j < lines2; j++) {
             bid = i * blocksPerSide + j;
-            res.ins.push_back(MergeIns(horIds[j], to_string(bid)));
+            res.ins.push_back(MergeIns(horIds[j], blockIds.root(bid)));
             res.score += mergeCost(blockSize, blockSize * i, blockSize);
-            horIds[j] = to_string(nextBlockId);
+            horIds[j] = blockIds.root(nextBlockId);
             nextBlockId++;
         }
     }
 
-    string prevHorId = horIds[0];
+    BlockId prevHorId = horIds[0];
     for (int i = 1; i < lines2; i++) {
         res.ins.push_back(MergeIns(horIds[i], prevHorId));
         res.score += mergeCost(N, blockSize * i, blockSize);
-        prevHorId = to_string(nextBlockId);
+        prevHorId = blockIds.root(nextBlockId);
         nextBlockId++;
     }
 
     curId = prevHorId;
-    vector<string> verIds(blocksPerSide);
+    vector<BlockId> verIds(blocksPerSide);
     for (int i = blocksPerSide - 1; i >= lines1; i--) {
         res.ins.push_back(SplitXIns(curId, i * N / blocksPerSide));
         res.score += splitLineCost(lines2 * blockSize, (i + 1) * blockSize);
-        verIds[i] = curId + ".1";
-        curId += ".0";
+        verIds[i] = blockIds.child(curId, 1);
+        curId = blockIds.child(curId, 0);
     }
     auto rest2 = curId;
 
     for (int i = lines1; i < blocksPerSide; i++) {
         for (int j = lines2; j < blocksPerSide; j++) {
             bid = i * blocksPerSide + j;
-            res.ins.push_back(MergeIns(verIds[i], to_string(bid)));
+            res.ins.push_back(MergeIns(verIds[i], blockIds.root(bid)));
             res.score += mergeCost(blockSize, blockSize * j, blockSize);
-            verIds[i] = to_string(nextBlockId);
+            verIds[i] = blockIds.root(nextBlockId);
             nextBlockId++;
         }
     }
 
-    string prevVerId = verIds.back();
+    BlockId prevVerId = verIds.back();
     for (int i = blocksPerSide - 2; i >= lines1; i--) {
         res.ins.push_back(MergeIns(verIds[i], prevVerId));
         res.score += mergeCost(N, blockSize * (blocksPerSide - 1 - i), blockSize);
-        prevVerId = to_string(nextBlockId);
+        prevVerId = blockIds.root(nextBlockId);
         nextBlockId++;
     }
 
@@ -661,7 +320,7 @@ pair<Solution, int> getThreeStepMerge(int blocksPerSide, int blockSize, int line
     res.score += mergeCost(lines1 * blockSize, lines2 * blockSize, (blocksPerSide - lines2) * blockSize);
     nextBlockId++;
 
-    res.ins.push_back(MergeIns(to_string(nextBlockId - 1), rest3));
+    res.ins.push_back(MergeIns(blockIds.root(nextBlockId - 1), rest3));
     res.score += mergeCost(N, lines1 * blockSize, (blocksPerSide - lines1) * blockSize);
     nextBlockId++;
 
@@ -682,16 +341,16 @@ pair<Solution, int> linesMerge() {
     const int BSq = BS * BS;
     assert(N == M);
 
-    vector<vector<string>> blocks(B, vector<string>(B));
+    vector<vector<BlockId>> blocks(B, vector<BlockId>(B));
     for (int i = 0; i < B; i++)
         for (int j = 0; j < B; j++)
-            blocks[i][j] = to_string(i + j * B);
+            blocks[i][j] = blockIds.root(i + j * B);
 
     Solution res;
     res.score = 0;
     int nextBlockId = B * B;
 
-    auto getSize = [&](const string& ii) {
+    auto getSize = [&](BlockId ii) {
         int cnt = 0;
         for (int i = 0; i < B; i++)
             for (int j = 0; j < B; j++)
@@ -699,10 +358,10 @@ pair<Solution, int> linesMerge() {
         return cnt * BSq;
     };
 
-    auto makeMerge = [&](string i1, string i2) {
+    auto makeMerge = [&](BlockId i1, BlockId i2) {
         res.ins.push_back(MergeIns(i1, i2));
         res.score += mergeCost(getSize(i1), getSize(i2));
-        string sid = to_string(nextBlockId);
+        BlockId sid = blockIds.root(nextBlockId);
         nextBlockId++;
         for (int i = 0; i < B; i++)
             for (int j = 0; j < B; j++)
@@ -710,11 +369,11 @@ pair<Solution, int> linesMerge() {
                     blocks[i][j] = sid;
     };
 
-    auto makeSplitX = [&](string ii, int val) {
+    auto makeSplitX = [&](BlockId ii, int val) {
         res.ins.push_back(SplitXIns(ii, val * BS));
         res.score += splitLineCost(getSize(ii));
-        string id1 = ii + ".0";
-        string id2 = ii + ".1";
+        BlockId id1 = blockIds.child(ii, 0);
+        BlockId id2 = blockIds.child(ii, 1);
         // cerr << blocks[1][2] << " " << ii << " " << (blocks[1][2] == ii) << " B = " << B << endl;
         for (int i = 0; i < B; i++)
             for (int j = 0; j < B; j++) 
@@ -733,11 +392,11 @@ pair<Solution, int> linesMerge() {
 
     cerr << "! " << res.score << endl;
 
-    auto makeSplitY = [&](string ii, int val) {
+    auto makeSplitY = [&](BlockId ii, int val) {
         res.ins.push_back(SplitYIns(ii, val * BS));
         res.score += splitLineCost(getSize(ii));
-        string id1 = ii + ".0";
-        string id2 = ii + ".1";
+        BlockId id1 = blockIds.child(ii, 0);
+        BlockId id2 = blockIds.child(ii, 1);
         for (int i = 0; i < B; i++)
             for (int j = 0; j < B; j++)
                 if (blocks[i][j] == ii) {
@@ -811,16 +470,16 @@ pair<Solution, int> dpMerge() {
     const int BSq = BS * BS;
     assert(N == M);
 
-    vector<vector<string>> blocks(B, vector<string>(B));
+    vector<vector<BlockId>> blocks(B, vector<BlockId>(B));
     for (int i = 0; i < B; i++)
         for (int j = 0; j < B; j++)
-            blocks[i][j] = to_string(i + j * B);
+            blocks[i][j] = blockIds.root(i + j * B);
 
     Solution res;
     res.score = 0;
     int nextBlockId = B * B;
 
-    auto getSize = [&](const string& ii) {
+    auto getSize = [&](BlockId ii) {
         int cnt = 0;
         for (int i = 0; i < B; i++)
             for (int j = 0; j < B; j++)
@@ -828,10 +487,10 @@ pair<Solution, int> dpMerge() {
         return cnt * BSq;
     };
 
-    auto makeMerge = [&](string i1, string i2) {
+    auto makeMerge = [&](BlockId i1, BlockId i2) {
         res.ins.push_back(MergeIns(i1, i2));
         res.score += mergeCost(getSize(i1), getSize(i2));
-        string sid = to_string(nextBlockId);
+        BlockId sid = blockIds.root(nextBlockId);
         nextBlockId++;
         for (int i = 0; i < B; i++)
             for (int j = 0; j < B; j++)
@@ -839,11 +498,11 @@ pair<Solution, int> dpMerge() {
                     blocks[i][j] = sid;
     };
 
-    auto makeSplitX = [&](string ii, int val) {
+    auto makeSplitX = [&](BlockId ii, int val) {
         res.ins.push_back(SplitXIns(ii, val * BS));
         res.score += splitLineCost(getSize(ii));
-        string id1 = ii + ".0";
-        string id2 = ii + ".1";
+        BlockId id1 = blockIds.child(ii, 0);
+        BlockId id2 = blockIds.child(ii, 1);
         for (int i = 0; i < B; i++)
             for (int j = 0; j < B; j++) 
                 if (blocks[i][j] == ii) {
@@ -858,11 +517,11 @@ pair<Solution, int> dpMerge() {
 
     cerr << "! " << res.score << endl;
 
-    auto makeSplitY = [&](string ii, int val) {
+    auto makeSplitY = [&](BlockId ii, int val) {
         res.ins.push_back(SplitYIns(ii, val * BS));
         res.score += splitLineCost(getSize(ii));
-        string id1 = ii + ".0";
-        string id2 = ii + ".1";
+        BlockId id1 = blockIds.child(ii, 0);
+        BlockId id2 = blockIds.child(ii, 1);
         for (int i = 0; i < B; i++)
             for (int j = 0; j < B; j++)
                 if (blocks[i][j] == ii) {
@@ -1175,7 +834,7 @@ pair<Solution, int> initialMerge() {
         int prevBlockId = bid;
         bid++;
         for (int j = 1; j < blocksPerSide; j++) {
-            res.ins.push_back(MergeIns(to_string(prevBlockId), to_string(bid)));
+            res.ins.push_back(MergeIns(blockIds.root(prevBlockId), blockIds.root(bid)));
             res.score += mergeCost(blockSize, blockSize * j, blockSize);
             prevBlockId = nextBlockId;
             nextBlockId++;
@@ -1185,7 +844,7 @@ pair<Solution, int> initialMerge() {
     }
     int prevBlockId = vertBlocks[0];
     for (int i = 1; i < blocksPerSide; i++) {
-        res.ins.push_back(MergeIns(to_string(prevBlockId), to_string(vertBlocks[i])));
+        res.ins.push_back(MergeIns(blockIds.root(prevBlockId), blockIds.root(vertBlocks[i])));
         res.score += mergeCost(N, blockSize * i, blockSize);
         prevBlockId = nextBlockId;
         nextBlockId++;
@@ -1237,171 +896,269 @@ int PaintCost(int x, int y) {
   return ret + min(cand1, cand2);
 }
 
-void solveGena(int S, int mode) {
-/*    if (S == -1) {
-      S = ::S;
+// Paints [x, N) x [y, M) of the whole-canvas block root(idx) with c: cut at
+// the corner, color the far part and merge back in the order PaintCost picks
+// as cheaper. idx moves to the merged block.
+void paintCorner(vector<Instruction>& ins, int& idx, int x, int y, const Color& c) {
+  auto Compare = [&](int x, int y) {
+    int cand1 = llround(costs.merge * (N * M) / (max(x, N - x) * y));
+    cand1    += llround(costs.merge * (N * M) / (max(x, N - x) * (M - y)));
+    cand1    += llround(costs.merge * M / max(y, M - y));
+    int cand2 = llround(costs.merge * (N * M) / (x * max(y, M - y)));
+    cand2    += llround(costs.merge * (N * M) / ((N - x) * max(y, M - y)));
+    cand2    += llround(costs.merge * N / max(x, M - x));
+    return cand1 < cand2;
+  };
+  BlockId cur = blockIds.root(idx);
+  if (x == 0 && y == 0) {
+    ins.push_back(ColorIns(cur, c));
+  }
+  if (x == 0 && y > 0) {
+    ins.push_back(SplitYIns(cur, y));
+    ins.push_back(ColorIns(blockIds.child(cur, 1), c));
+    ins.push_back(MergeIns(blockIds.child(cur, 0), blockIds.child(cur, 1)));
+    idx += 1;
+  }
+  if (x > 0 && y == 0) {
+    ins.push_back(SplitXIns(cur, x));
+    ins.push_back(ColorIns(blockIds.child(cur, 1), c));
+    ins.push_back(MergeIns(blockIds.child(cur, 0), blockIds.child(cur, 1)));
+    idx += 1;
+  }
+  if (x > 0 && y > 0) {
+    ins.push_back(SplitPointIns(cur, x, y));
+    ins.push_back(ColorIns(blockIds.child(cur, 2), c));
+    if (Compare(N - x, M - y)) {
+      ins.push_back(MergeIns(blockIds.child(cur, 3), blockIds.child(cur, 2)));
+      ins.push_back(MergeIns(blockIds.child(cur, 0), blockIds.child(cur, 1)));
+    } else {
+      ins.push_back(MergeIns(blockIds.child(cur, 3), blockIds.child(cur, 0)));
+      ins.push_back(MergeIns(blockIds.child(cur, 2), blockIds.child(cur, 1)));
+    }
+    ins.push_back(MergeIns(blockIds.root(idx + 1), blockIds.root(idx + 2)));
+    idx += 3;
+  }
+}
+
+// The target turned `mode` times clockwise with its summed-area tables and the
+// rect cache of its test, built once per direction and shared by every lattice
+// solved on it.
+struct GenaTarget {
+    int mode = 0;
+    Canvas colors;
+    shared_ptr<RectCache> cache;
+    vector<vector<vector<int>>> pref;
+    // sum over channels of squared values, to get a rect's SSD in O(1)
+    vector<vector<long long>> pref_sq;
+};
+
+GenaTarget genaTarget(int mode, shared_ptr<RectCache> cache) {
+    GenaTarget t;
+    t.mode = mode;
+    t.cache = move(cache);
+    Canvas& target_colors = t.colors;
+    target_colors = colors;
+    for (int rep = 0; rep < mode; rep++) {
+      target_colors = target_colors.rotatedClockwise();
     }
-    if (mode == -1) {
-      mode = ::mode;
-    }*/
-    if (S < 2) {
-      msg.clear() << "sorry, S must be at least 2";
-      return;
+    auto& pref = t.pref;
+    pref.assign(N + 1, vector<vector<int>>(M + 1, vector<int>(4)));
+    for (int i = 0; i <= N; i++) {
+      for (int j = 0; j <= M; j++) {
+        for (int k = 0; k < 4; k++) {
+          if (i == 0 || j == 0) {
+            pref[i][j][k] = 0;
+          } else {
+            pref[i][j][k] = pref[i - 1][j][k] + pref[i][j - 1][k] - pref[i - 1][j - 1][k] + target_colors[i - 1][j - 1][k];
+          }
+        }
+      }
     }
-    if (N % S != 0 || M % S != 0) {
-      msg.clear() << "sorry, N and M should be divisible by S";
-      return;
+    auto& pref_sq = t.pref_sq;
+    pref_sq.assign(N + 1, vector<long long>(M + 1));
+    for (int i = 1; i <= N; i++) {
+      for (int j = 1; j <= M; j++) {
+        int sq = 0;
+        for (int k = 0; k < 4; k++) {
+          sq += sqr(target_colors[i - 1][j - 1][k]);
+        }
+        pref_sq[i][j] = pref_sq[i - 1][j] + pref_sq[i][j - 1] - pref_sq[i - 1][j - 1] + sq;
+      }
+    }
+    return t;
+}
+
+// Pixel coordinates of solveGena's lattice on t, columns xs and rows ys: every
+// S pixels, or with lines > 0 that many image-picked lines per axis (see
+// cutLines).
+void genaLattice(const GenaTarget& t, int S, int lines, vector<int>& xs, vector<int>& ys) {
+    xs.clear();
+    ys.clear();
+    if (lines > 0) {
+      xs = cutLines(t.colors.rotatedClockwise(), lines);
+      ys = cutLines(t.colors, lines);
+    } else {
+      for (int i = 0; i * S <= t.colors.m; i++) {
+        xs.push_back(i * S);
+      }
+      for (int i = 0; i * S <= t.colors.n; i++) {
+        ys.push_back(i * S);
+      }
     }
+}
+
+// One orientation of solveGena: the DP runs on the lattice xs x ys of the
+// turned target and the plan is rotated back. Only touches its own arguments,
+// so several orientations can run side by side; progress goes to msg if
+// report.
+void runGena(const GenaTarget& t, const vector<int>& xs, const vector<int>& ys, const pair<Solution, int>& initial,
+             int threads, bool report, Solution& res, vector<pair<int, int>>& corners) {
     auto start_time = Time::now();
     auto GetTime = [&]() {
       auto cur_time = Time::now();
       std::chrono::duration<double> fs = cur_time - start_time;
       return std::chrono::duration_cast<chrono_ms>(fs).count() * 0.001;
     };
-    msg.clear() << "Running...";
-    vector<vector<Color>> target_colors(N, vector<Color>(N));
-    for (int i = 0; i < N; i++) {
-      for (int j = 0; j < N; j++) {
-        target_colors[i][j] = colors[i][j];
+    if (report) msg.clear() << "Running...";
+    int mode = t.mode;
+    const Canvas& target_colors = t.colors;
+    const auto& pref = t.pref;
+    const auto& pref_sq = t.pref_sq;
+    RectCache& cache = *t.cache;
+    int n = (int) xs.size() - 1;
+    int m = (int) ys.size() - 1;
+
+    assert(N == M);
+    IntervalTable dp(n, m);
+    // Bounds on sum ||p - c|| over rows [r1, r2) and columns [c1, c2):
+    // from below by ||sum (p - c)|| (triangle inequality) and by SSD / 510,
+    // as no distance exceeds 510; from above by sqrt(cnt * SSD).
+    auto Bounds = [&](int r1, int c1, int r2, int c2, const Color& c) {
+      long long cnt = (long long) (r2 - r1) * (c2 - c1);
+      long long ssd = pref_sq[r2][c2] - pref_sq[r1][c2] - pref_sq[r2][c1] + pref_sq[r1][c1];
+      double off = 0;
+      for (int k = 0; k < 4; k++) {
+        long long sum = pref[r2][c2][k] - pref[r1][c2][k] - pref[r2][c1][k] + pref[r1][c1][k];
+        ssd += c[k] * (cnt * c[k] - 2 * sum);
+        off += sqr((double) (sum - cnt * c[k]));
       }
-    }
-    for (int rep = 0; rep < mode; rep++) {
-      vector<vector<Color>> rotated(N, vector<Color>(N));
-      for (int i = 0; i < N; i++) {
-        for (int j = 0; j < N; j++) {
-          rotated[j][N - 1 - i] = target_colors[i][j];
-        }
+      // the slack keeps float error from turning a bound into an overestimate
+      return pair<double, double>(max(sqrt(off), ssd / 510.0) * (1 - 1e-9), sqrt((double) cnt * ssd) * (1 + 1e-9));
+    };
+    auto Eval = [&](int xa, int ya, int xb, int yb) {
+      int ft = (int) 1e9;
+      for (int x = xa + 1; x < xb; x++) {
+        ft = min(ft, dp.at(xa, x, ya, yb) + dp.at(x, xb, ya, yb));
       }
-      for (int i = 0; i < N; i++) {
-        for (int j = 0; j < N; j++) {
-          target_colors[i][j] = rotated[i][j];
-        }
+      for (int y = ya + 1; y < yb; y++) {
+        ft = min(ft, dp.at(xa, xb, ya, y) + dp.at(xa, xb, y, yb));
       }
-    }
-    int n = N / S;
-    int m = M / S;
-    vector<vector<vector<int>>> pref(N + 1, vector<vector<int>>(M + 1, vector<int>(4)));
-    for (int i = 0; i <= N; i++) {
-      for (int j = 0; j <= M; j++) {
-        for (int k = 0; k < 4; k++) {
-          if (i == 0 || j == 0) {
-            pref[i][j][k] = 0;
+      int area = (xs[xb] - xs[xa]) * (ys[yb] - ys[ya]);
+      Color paint_into;
+      for (int k = 0; k < 4; k++) {
+        int sum = pref[ys[yb]][xs[xb]][k] - pref[ys[ya]][xs[xb]][k] - pref[ys[yb]][xs[xa]][k] + pref[ys[ya]][xs[xa]][k];
+        paint_into[k] = (2 * sum + area) / (2 * area);
+      }
+      long long penalty = 1000 * PaintCost(N - xs[xa], M - ys[ya]);
+      int r1 = ys[ya], r2 = ys[yb], c1 = xs[xa], c2 = xs[xb];
+      auto [lower, upper] = Bounds(r1, c1, r2, c2, paint_into);
+      if (penalty + llround(lower * 5) < ft) {
+        if (llround(lower * 5) == llround(upper * 5)) {
+          // both bounds round to the same cost (e.g. a flat rect), no scan needed
+          ft = (int) (penalty + llround(lower * 5));
+        } else {
+          Pixel p = toPixel(paint_into);
+          int64_t cached;
+          bool exact = false;
+          bool hit = cache.find(kFillMean, mode, r1, c1, r2, c2, p, cached, exact);
+          if (hit && (exact || penalty + cached >= ft)) {
+            ft = min(ft, (int) (penalty + cached));
           } else {
-            pref[i][j][k] = pref[i - 1][j][k] + pref[i][j - 1][k] - pref[i - 1][j - 1][k] + target_colors[i - 1][j - 1][k];
+            double diff = 0, bound = 0;
+            bool pruned = false;
+            for (int y = r1; y < r2 && !pruned; y++) {
+              diff += distSum(target_colors[y] + c1, c2 - c1, p);
+              double rest = y + 1 < r2 ? Bounds(y + 1, c1, r2, c2, paint_into).first : 0;
+              bound = diff + rest;
+              pruned = penalty + llround(bound * 5) >= ft;
+            }
+            // a cut scan still leaves a bound that prunes the rect next time
+            cache.insert(kFillMean, mode, r1, c1, r2, c2, p, llround((pruned ? bound : diff) * 5), !pruned);
+            if (!pruned) {
+              ft = (int) (penalty + llround(diff * 5));
+            }
           }
         }
       }
-    }
-    const int MAX_D = 255 * 255 * 4;
-    vector<double> SQRT(MAX_D + 1);
-    for (int i = 0; i <= MAX_D; i++) {
-      SQRT[i] = sqrt(i);
-    }
-
-    {
-      assert(N == M);
-      int tmp = 0;
-      for (int xa = 0; xa < n; xa++) {
-        for (int xb = xa + 1; xb <= n; xb++) {
-          aux[xa][xb] = tmp++;
+      dp.at(xa, xb, ya, yb) = ft;
+    };
+    if (threads == 1) {
+      for (int xa = n - 1; xa >= 0; xa--) {
+        if (report) msg.clear() << "n = " << n << ", xa = " << xa << ", time = " << GetTime() << "s\n";
+        for (int ya = m - 1; ya >= 0; ya--) {
+          for (int xb = xa + 1; xb <= n; xb++) {
+            for (int yb = ya + 1; yb <= m; yb++) {
+              Eval(xa, ya, xb, yb);
+            }
+          }
         }
       }
-    }
-    int zzseed = time(0);
-    mt19937 rng(zzseed);
-    for (int xa = n - 1; xa >= 0; xa--) {
-      auto time_elapsed = GetTime();
-      msg.clear() << "n = " << n << ", xa = " << xa << ", time = " << time_elapsed << "s\n";
-      for (int ya = m - 1; ya >= 0; ya--) {
-        for (int xb = xa + 1; xb <= n; xb++) {
-          for (int yb = ya + 1; yb <= m; yb++) {
-            int ft = (int) 1e9;
-            for (int x = xa + 1; x < xb; x++) {
-              ft = min(ft, dp[aux[xa][x]][aux[ya][yb]] + dp[aux[x][xb]][aux[ya][yb]]);
-            }
-            for (int y = ya + 1; y < yb; y++) {
-              ft = min(ft, dp[aux[xa][xb]][aux[ya][y]] + dp[aux[xa][xb]][aux[y][yb]]);
-            }
-            int area = (xb - xa) * (yb - ya) * S * S;
-            Color paint_into;
-            for (int k = 0; k < 4; k++) {
-              int sum = pref[yb * S][xb * S][k] - pref[ya * S][xb * S][k] - pref[yb * S][xa * S][k] + pref[ya * S][xa * S][k];
-              paint_into[k] = (2 * sum + area) / (2 * area);
-            }
-            long long penalty = 1000 * PaintCost(N - xa * S, M - ya * S);
-            if (penalty < ft) {
-              double diff_est = 0;
-              if (area >= S) {
-                for (int y = ya * S; y < yb * S; y++) {
-                  int x = xa * S + (int) (rng() % (xb * S - xa * S));
-                  int sum_sq = 0;
-                  for (int k = 0; k < 4; k++) {
-                    sum_sq += sqr(target_colors[y][x][k] - paint_into[k]);
-                  }
-                  diff_est += SQRT[sum_sq];
-                }
-              }
-              diff_est *= xb * S - xa * S;
-              if (penalty + llround(diff_est * 5 * 0.8) < ft) {
-                double diff = 0;
-                for (int y = ya * S; y < yb * S; y++) {
-                  for (int x = xa * S; x < xb * S; x++) {
-                    int sum_sq = 0;
-                    for (int k = 0; k < 4; k++) {
-                      sum_sq += sqr(target_colors[y][x][k] - paint_into[k]);
-                    }
-                    diff += SQRT[sum_sq];
-                  }
-                  if (penalty + llround(diff * 5) >= ft) {
-                    break;
-                  }
-                }
-                penalty += llround(diff * 5);
-                ft = min(ft, (int) penalty);
-              }
+    } else {
+      // A rect only reads rects with a smaller (xb - xa) + (yb - ya), so every
+      // wave of equal half-perimeter is independent.
+      vector<array<int, 4>> wave;
+      for (int d = 2; d <= n + m; d++) {
+        wave.clear();
+        for (int w = max(1, d - m); w <= min(n, d - 1); w++) {
+          for (int xa = 0; xa + w <= n; xa++) {
+            for (int ya = 0; ya + d - w <= m; ya++) {
+              wave.push_back({xa, ya, xa + w, ya + d - w});
             }
-            dp[aux[xa][xb]][aux[ya][yb]] = ft;
           }
         }
+        parallelFor(wave.size(), [&](int i) {
+          Eval(wave[i][0], wave[i][1], wave[i][2], wave[i][3]);
+        }, threads);
+        if (report) msg.clear() << "n = " << n << ", wave " << d << "/" << n + m << ", time = " << GetTime() << "s\n";
       }
     }
-    msg << "dp = " << dp[aux[0][n]][aux[0][m]] / 1000 << "\n";
+    if (report) msg << "dp = " << dp.at(0, n, 0, m) / 1000 << "\n";
     vector<pair<array<int, 4>, Color>> rects;
     vector<vector<int>> rect_id(n, vector<int>(m, -1));
+    Palette palette;
     function<void(int, int, int, int)> Reconstruct = [&](int xa, int ya, int xb, int yb) {
-      int ft = dp[aux[xa][xb]][aux[ya][yb]];
+      int ft = dp.at(xa, xb, ya, yb);
       for (int x = xa + 1; x < xb; x++) {
-        if (dp[aux[xa][x]][aux[ya][yb]] + dp[aux[x][xb]][aux[ya][yb]] == ft) {
+        if (dp.at(xa, x, ya, yb) + dp.at(x, xb, ya, yb) == ft) {
           Reconstruct(xa, ya, x, yb);
           Reconstruct(x, ya, xb, yb);
           return;
         }
       }
       for (int y = ya + 1; y < yb; y++) {
-        if (dp[aux[xa][xb]][aux[ya][y]] + dp[aux[xa][xb]][aux[y][yb]] == ft) {
+        if (dp.at(xa, xb, ya, y) + dp.at(xa, xb, y, yb) == ft) {
           Reconstruct(xa, ya, xb, y);
           Reconstruct(xa, y, xb, yb);
           return;
         }
       }
-      int area = (xb - xa) * (yb - ya) * S * S;
-      Color paint_into;
-      for (int k = 0; k < 4; k++) {
-        int sum = pref[yb * S][xb * S][k] - pref[ya * S][xb * S][k] - pref[yb * S][xa * S][k] + pref[ya * S][xa * S][k];
-        paint_into[k] = (2 * sum + area) / (2 * area);
+      // the DP priced the mean; the painted color is the best one
+      palette.clear();
+      for (int y = ys[ya]; y < ys[yb]; y++) {
+        palette.add(target_colors[y] + xs[xa], xs[xb] - xs[xa]);
       }
       for (int x = xa; x < xb; x++) {
         for (int y = ya; y < yb; y++) {
           rect_id[x][y] = (int) rects.size();
         }
       }
-      rects.emplace_back(array<int, 4>{xa, ya, xb, yb}, paint_into);
+      rects.emplace_back(array<int, 4>{xa, ya, xb, yb}, bestFill(palette));
     };
     Reconstruct(0, 0, n, m);
-    auto [res_pref, idx] = initialMerge();
-    Solution res;
+    auto [res_pref, idx] = initial;
+    res.ins.clear();
     res.score = res_pref.score;
-    res.score += dp[aux[0][n]][aux[0][m]] / 1000;
+    res.score += dp.at(0, n, 0, m) / 1000;
     int rect_cnt = (int) rects.size();
     vector<vector<int>> graph(rect_cnt);
     vector<int> indegree(rect_cnt);
@@ -1443,54 +1200,13 @@ void solveGena(int S, int mode) {
       }
     }
     assert((int) que.size() == rect_cnt);
-    auto Compare = [&](int x, int y) {
-      int cand1 = llround(costs.merge * (n * m) / (max(x, n - x) * y));
-      cand1    += llround(costs.merge * (n * m) / (max(x, n - x) * (m - y)));
-      cand1    += llround(costs.merge * m / max(y, m - y));
-      int cand2 = llround(costs.merge * (n * m) / (x * max(y, m - y)));
-      cand2    += llround(costs.merge * (n * m) / ((n - x) * max(y, m - y)));
-      cand2    += llround(costs.merge * n / max(x, m - x));
-      return cand1 < cand2;
-    };
-    dp_corners.clear();
+    corners.clear();
     for (int it = 0; it < rect_cnt; it++) {
       int i = que[it];
       int xa = rects[i].first[0];
       int ya = rects[i].first[1];
-      int xb = rects[i].first[2];
-      int yb = rects[i].first[3];
-      dp_corners.emplace_back(xa * S, ya * S);
-      Color paint_into = rects[i].second;
-      if (mode >= 0) {
-        if (xa == 0 && ya == 0) {
-          res.ins.push_back(ColorIns(to_string(idx), paint_into));
-        }
-        if (xa == 0 && ya > 0) {
-          res.ins.push_back(SplitYIns(to_string(idx), ya * S));
-          res.ins.push_back(ColorIns(to_string(idx) + ".1", paint_into));
-          res.ins.push_back(MergeIns(to_string(idx) + ".0", to_string(idx) + ".1"));
-          idx += 1;
-        }
-        if (xa > 0 && ya == 0) {
-          res.ins.push_back(SplitXIns(to_string(idx), xa * S));
-          res.ins.push_back(ColorIns(to_string(idx) + ".1", paint_into));
-          res.ins.push_back(MergeIns(to_string(idx) + ".0", to_string(idx) + ".1"));
-          idx += 1;
-        }
-        if (xa > 0 && ya > 0) {
-          res.ins.push_back(SplitPointIns(to_string(idx), xa * S, ya * S));
-          res.ins.push_back(ColorIns(to_string(idx) + ".2", paint_into));
-          if (Compare(n - xa, n - ya)) {
-            res.ins.push_back(MergeIns(to_string(idx) + ".3", to_string(idx) + ".2"));
-            res.ins.push_back(MergeIns(to_string(idx) + ".0", to_string(idx) + ".1"));
-          } else {
-            res.ins.push_back(MergeIns(to_string(idx) + ".3", to_string(idx) + ".0"));
-            res.ins.push_back(MergeIns(to_string(idx) + ".2", to_string(idx) + ".1"));
-          }
-          res.ins.push_back(MergeIns(to_string(idx + 1), to_string(idx + 2)));
-          idx += 3;
-        }
-      }
+      corners.emplace_back(xs[xa], ys[ya]);
+      paintCorner(res.ins, idx, xs[xa], ys[ya], rects[i].second);
     }
 
     for (int rep = 0; rep < mode; rep++) {
@@ -1498,823 +1214,1668 @@ void solveGena(int S, int mode) {
     }
     res.ins.insert(res.ins.begin(), res_pref.ins.begin(), res_pref.ins.end());
 
-    msg << "Duration: " << GetTime() << "s\n";
-    postprocess(res);
+    if (report) msg << "Duration: " << GetTime() << "s\n";
 }
 
-void solveOpt() {
-//    solveGena(10, 0);
-    auto init_corners = dp_corners;
+// Runs solve(target, threads, report, res, corners) for direction mode, or
+// for all four at once when mode == 4, and hands the plan the painter scores
+// best to postprocess.
+void solveDirections(int mode, const function<void(const GenaTarget&, int, bool, Solution&,
+                                                   vector<pair<int, int>>&)>& solve) {
+    auto cache = atomic_load(&rectCache);
+    if (mode < 4) {
+      Solution res;
+      solve(genaTarget(mode, cache), dpThreads, true, res, dp_corners);
+      postprocess(res);
+      return;
+    }
     auto start_time = Time::now();
-    auto GetTime = [&]() {
-      auto cur_time = Time::now();
-      std::chrono::duration<double> fs = cur_time - start_time;
-      return std::chrono::duration_cast<chrono_ms>(fs).count() * 0.001;
-    };
-    msg.clear() << "Running...\n";
-    auto myColoredBlocks = coloredBlocks;
-    vector<vector<Color>> target_colors(N, vector<Color>(N));
-    for (int i = 0; i < N; i++) {
-      for (int j = 0; j < N; j++) {
-        target_colors[i][j] = colors[i][j];
+    // each direction gets its share of the cores for its own waves
+    int threads = dpThreads ? dpThreads : max(1u, thread::hardware_concurrency() / 4);
+    array<Solution, 4> sols;
+    array<vector<pair<int, int>>, 4> corners;
+    array<int, 4> scores;
+    parallelFor(4, [&](int d) {
+      solve(genaTarget(d, cache), threads, d == 0, sols[d], corners[d]);
+      Painter p(N, M, rawBlocks, colors, costs);
+      scores[d] = INT_MAX;
+      for (const auto& ins : sols[d].ins) {
+        if (!p.doInstruction(ins)) {
+          return;
+        }
       }
+      scores[d] = p.totalScore();
+    }, 4);
+    int best = min_element(scores.begin(), scores.end()) - scores.begin();
+    msg.clear() << "Directions:";
+    for (int d = 0; d < 4; d++) {
+      msg << " " << scores[d];
+    }
+    std::chrono::duration<double> fs = Time::now() - start_time;
+    msg << "\nBest D=" << best << ", duration: " << fs.count() << "s\n";
+    dp_corners = corners[best];
+    postprocess(sols[best]);
+}
+
+bool genaStepValid(int S) {
+    if (S < 2) {
+      msg.clear() << "sorry, S must be at least 2";
+      return false;
     }
-    int mode = 0;
-    while (mode < 4) {
-      bool ok = true;
-      for (auto& block : myColoredBlocks) {
-        if (block.r2 != N || block.c2 != N) {
-          ok = false;
-          break;
+    if (N % S != 0 || M % S != 0) {
+      msg.clear() << "sorry, N and M should be divisible by S";
+      return false;
+    }
+    return true;
+}
+
+// mode 0..3 picks the direction, 4 runs all four at once and keeps the plan
+// the painter scores best. gridLines > 0 replaces the S grid.
+void solveGena(int S, int mode) {
+    int lines = gridLines;
+    if (lines <= 0 && !genaStepValid(S)) {
+      return;
+    }
+    auto initial = initialMerge();
+    solveDirections(mode, [&](const GenaTarget& t, int threads, bool report, Solution& res,
+                              vector<pair<int, int>>& corners) {
+      vector<int> xs, ys;
+      genaLattice(t, S, lines, xs, ys);
+      runGena(t, xs, ys, initial, threads, report, res, corners);
+    });
+}
+
+// Lines of a step-pixel level: the cuts of the previous level's partition
+// and every multiple of step closer than prev to one of them, so each cut can
+// move by up to a previous cell.
+vector<int> refineLines(const set<int>& cuts, int step, int prev) {
+    set<int> lines = cuts;
+    for (int c : cuts) {
+      for (int v = (c - prev) / step * step; v < c + prev; v += step) {
+        if (v > *cuts.begin() && v < *cuts.rbegin() && abs(v - c) < prev) {
+          lines.insert(v);
         }
       }
-      if (ok) {
-        break;
-      }
-      for (auto& block : myColoredBlocks) {
-        swap(block.c1, block.r1);
-        block.c1 = N - block.c1;
-        swap(block.c2, block.r2);
-        block.c2 = N - block.c2;
-        swap(block.c1, block.c2);
-      }
-      vector<vector<Color>> rotated(N, vector<Color>(N));
-      for (int i = 0; i < N; i++) {
-        for (int j = 0; j < N; j++) {
-          rotated[j][N - 1 - i] = target_colors[i][j];
+    }
+    return vector<int>(lines.begin(), lines.end());
+}
+
+// Coarse-to-fine solveGena: solves the S grid, then re-solves at S / 2,
+// S / 4, .. on lattices that only add lines around the previous partition's
+// cuts (refineLines). Stops before a level would exceed pyramidLines lines
+// per axis. Every level contains the previous partition, so it can only
+// improve; all levels share one GenaTarget and the rect cache.
+bool solvePyramid(int S, int mode) {
+    if (!genaStepValid(S)) {
+      return false;
+    }
+    auto initial = initialMerge();
+    solveDirections(mode, [&](const GenaTarget& t, int threads, bool report, Solution& res,
+                              vector<pair<int, int>>& corners) {
+      vector<int> xs, ys;
+      genaLattice(t, S, 0, xs, ys);
+      runGena(t, xs, ys, initial, threads, report, res, corners);
+      stringstream levels;
+      levels << "S=" << S << ": " << res.score;
+      for (int prev = S, step = S / 2; step >= 1; prev = step, step /= 2) {
+        set<int> cx = {0, t.colors.m}, cy = {0, t.colors.n};
+        for (auto [x, y] : corners) {
+          cx.insert(x);
+          cy.insert(y);
+        }
+        xs = refineLines(cx, step, prev);
+        ys = refineLines(cy, step, prev);
+        if ((int) max(xs.size(), ys.size()) > pyramidLines + 1) {
+          break;
+        }
+        Solution finer;
+        vector<pair<int, int>> finer_corners;
+        runGena(t, xs, ys, initial, threads, report, finer, finer_corners);
+        levels << ", S=" << step << " (" << xs.size() - 1 << "x" << ys.size() - 1 << "): " << finer.score;
+        if (finer.score <= res.score) {
+          res = finer;
+          corners = finer_corners;
         }
       }
-      for (int i = 0; i < N; i++) {
-        for (int j = 0; j < N; j++) {
-          target_colors[i][j] = rotated[i][j];
-        }
-      }
-      mode += 1;
-    }
-    cerr << "mode = " << mode << endl;
-    assert(mode < 4);
-    vector<vector<pair<int, int>>> top(N, vector<pair<int, int>>(N));
-    vector<vector<list<pair<int, int>>::iterator>> iter(N, vector<list<pair<int, int>>::iterator>(N));
-    vector<vector<list<pair<int, int>>>> cells(N, vector<list<pair<int, int>>>(N));
-    for (int i = 0; i < N; i++) {
-      for (int j = 0; j < N; j++) {
-        top[i][j] = make_pair(0, 0);
-        cells[0][0].emplace_back(i, j);
-        iter[i][j] = prev(cells[0][0].end());
-      }
-    }
-    int n = N;
-    int m = M;
-    const int MAX_D = 255 * 255 * 4;
-    vector<double> SQRT(MAX_D + 1);
-    for (int i = 0; i <= MAX_D; i++) {
-      SQRT[i] = sqrt(i);
-    }
-    vector<vector<int>> base_cost(N, vector<int>(N));
-    for (int i = 0; i < N; i++) {
-      for (int j = 0; j < N; j++) {
-        base_cost[i][j] = 1000 * PaintCost(N - i, N - j);
+      if (report) {
+        msg << levels.str() << "\n";
       }
+    });
+    return true;
+}
+
+// Staircase DP on the S grid. f(r, c) paints [r, N) x [c, M) as either a
+// column strip [r, N) x [c, c2) followed by f(r, c2), or a row strip
+// [r, r2) x [c, M) followed by f(r2, c). A strip is a chain of corner paints
+// (opsCost), each seen until the next corner of the chain and filled with the
+// floor average of that part. Strips that run to the bottom and to the right
+// edge at once may continue either way.
+void solveDP2() {
+    if (S < 1 || N % S != 0 || M % S != 0) {
+        msg.clear() << "sorry, N and M should be divisible by S";
+        return;
     }
-    vector<pair<int, int>> corners;
-    vector<vector<int>> pos_in_corners(N, vector<int>(N, -1));
-    auto Priority = [&](pair<int, int> x) {
-      return pos_in_corners[x.first][x.second];
+    auto start_time = Time::now();
+    msg.clear() << "Running...\n";
+    int n = N / S, m = M / S;
+    vector<array<int, 4>> pref(size_t(N + 1) * (M + 1));
+    for (int i = 1; i <= N; i++) {
+        for (int j = 1; j <= M; j++) {
+            for (int q = 0; q < 4; q++) {
+                pref[i * (M + 1) + j][q] = pref[(i - 1) * (M + 1) + j][q] + pref[i * (M + 1) + j - 1][q] -
+                                           pref[(i - 1) * (M + 1) + j - 1][q] + colors[i - 1][j - 1][q];
+            }
+        }
+    }
+    // fill of grid rect [r1, r2) x [c1, c2)
+    auto Average = [&](int r1, int c1, int r2, int c2) {
+        r1 *= S, c1 *= S, r2 *= S, c2 *= S;
+        int total = (r2 - r1) * (c2 - c1);
+        Color avg;
+        for (int q = 0; q < 4; q++) {
+            int sum = pref[r2 * (M + 1) + c2][q] - pref[r1 * (M + 1) + c2][q] - pref[r2 * (M + 1) + c1][q] +
+                      pref[r1 * (M + 1) + c1][q];
+            avg[q] = sum / total;
+        }
+        return avg;
     };
-    auto Choose = [&](pair<int, int> x, pair<int, int> y) {
-      auto px = Priority(x);
-      auto py = Priority(y);
-      return (px > py ? x : y);
+    auto Step = [&](int r1, int c1, int r2, int c2, double rest) {
+        double cur = opsCost(r1 * S, c1 * S) + rest;
+        cur += distSumRect(colors, r1 * S, c1 * S, r2 * S, c2 * S, toPixel(Average(r1, c1, r2, c2))) * 0.005;
+        return cur;
     };
-    vector<vector<int>> cost(N, vector<int>(N, 0));
-    vector<vector<Color>> paint_into(N, vector<Color>(N, {-1, -1, -1, -1}));
-//    pos_in_corners[0][0] = 0;
-//    corners.emplace_back(0, 0);
-    int total = 0;
-    auto Recalc = [&](int i, int j) {
-      total -= cost[i][j];
-      assert(top[i][j] == make_pair(i, j));
-      assert(!cells[i][j].empty());
-      if (1 || paint_into[i][j][0] == -1) {
-        paint_into[i][j] = {0, 0, 0, 0};
-        for (auto& cell : cells[i][j]) {
-          for (int k = 0; k < 4; k++) {
-            paint_into[i][j][k] += target_colors[cell.second][cell.first][k];
-          }
+
+    // Pairs a < b < k are numbered as in IntervalTable, id[a * k + b], so the
+    // strip tables hold exactly the strips there are.
+    auto Number = [](int k, vector<int>& id) {
+        id.assign(size_t(k) * k, -1);
+        int cnt = 0;
+        for (int a = 0; a < k; a++)
+            for (int b = a + 1; b < k; b++)
+                id[a * k + b] = cnt++;
+        return size_t(cnt);
+    };
+    vector<int> downId, rightId;
+    size_t downPairs = Number(m, downId), rightPairs = Number(n, rightId);
+    // Best chain for a strip and where its first corner's part ends:
+    //   down[downId[c1 * m + c2] * n + r1]: [r1, N) x [c1, c2), c2 < m, next row
+    //   right[rightId[r1 * n + r2] * m + c1]: [r1, r2) x [c1, M), r2 < n, next column
+    //   both[r1 * m + c1]: [r1, N) x [c1, M), next row r > 0 or column -c
+    vector<double> down(downPairs * n), right(rightPairs * m), both(size_t(n) * m);
+    vector<int> downNext(down.size()), rightNext(right.size()), bothNext(both.size());
+    auto Chain = [&](int r1, int c1, int r2, int c2) {
+        if (r1 == n || c1 == m) return 0.0;
+        if (r2 == n && c2 == m) return both[r1 * m + c1];
+        if (r2 == n) return down[size_t(downId[c1 * m + c2]) * n + r1];
+        return right[size_t(rightId[r1 * n + r2]) * m + c1];
+    };
+    // Strips that stop short of an edge only continue along themselves, so
+    // every (c1, c2) and (r1, r2) is its own task.
+    vector<pair<int, int>> strips;
+    for (int a = 0; a < m; a++)
+        for (int b = a + 1; b < m; b++)
+            strips.emplace_back(a, b);
+    size_t downStrips = strips.size();
+    for (int a = 0; a < n; a++)
+        for (int b = a + 1; b < n; b++)
+            strips.emplace_back(a, b);
+    parallelFor(strips.size(), [&](int t) {
+        auto [a, b] = strips[t];
+        if (t < (int) downStrips) {
+            for (int r1 = n - 1; r1 >= 0; r1--) {
+                size_t at = size_t(downId[a * m + b]) * n + r1;
+                down[at] = 1e9;
+                for (int r = r1 + 1; r <= n; r++) {
+                    double cur = Step(r1, a, r, b, Chain(r, a, n, b));
+                    if (cur < down[at]) {
+                        down[at] = cur;
+                        downNext[at] = r;
+                    }
+                }
+            }
+        } else {
+            for (int c1 = m - 1; c1 >= 0; c1--) {
+                size_t at = size_t(rightId[a * n + b]) * m + c1;
+                right[at] = 1e9;
+                for (int c = c1 + 1; c <= m; c++) {
+                    double cur = Step(a, c1, b, c, Chain(a, c, b, m));
+                    if (cur < right[at]) {
+                        right[at] = cur;
+                        rightNext[at] = c;
+                    }
+                }
+            }
         }
-        int area = (int) cells[i][j].size();
-        for (int k = 0; k < 4; k++) {
-          paint_into[i][j][k] = (2 * paint_into[i][j][k] + area) / (2 * area);
+    }, dpThreads);
+    // both(r1, c1) reads larger r1 + c1 only
+    vector<pair<int, int>> wave;
+    for (int d = n + m - 2; d >= 0; d--) {
+        wave.clear();
+        for (int r1 = max(0, d - m + 1); r1 <= min(n - 1, d); r1++)
+            wave.emplace_back(r1, d - r1);
+        parallelFor(wave.size(), [&](int i) {
+            auto [r1, c1] = wave[i];
+            double& best = both[r1 * m + c1];
+            int& next = bothNext[r1 * m + c1];
+            best = 1e9;
+            for (int r = r1 + 1; r <= n; r++) {
+                double cur = Step(r1, c1, r, m, Chain(r, c1, n, m));
+                if (cur < best) {
+                    best = cur;
+                    next = r;
+                }
+            }
+            for (int c = c1 + 1; c <= m; c++) {
+                double cur = Step(r1, c1, n, c, Chain(r1, c, n, m));
+                if (cur < best) {
+                    best = cur;
+                    next = -c;
+                }
+            }
+        }, dpThreads);
+    }
+
+    // f[r][c] and its first strip: column strip to c2 > 0, or row strip to -r2
+    vector<vector<double>> f(n + 1, vector<double>(m + 1, 0));
+    vector<vector<int>> fNext(n + 1, vector<int>(m + 1, 0));
+    for (int r = n - 1; r >= 0; r--) {
+        for (int c = m - 1; c >= 0; c--) {
+            f[r][c] = 1e9;
+            for (int c2 = c + 1; c2 <= m; c2++) {
+                if (f[r][c2] + Chain(r, c, n, c2) < f[r][c]) {
+                    f[r][c] = f[r][c2] + Chain(r, c, n, c2);
+                    fNext[r][c] = c2;
+                }
+            }
+            for (int r2 = r + 1; r2 <= n; r2++) {
+                if (f[r2][c] + Chain(r, c, r2, m) < f[r][c]) {
+                    f[r][c] = f[r2][c] + Chain(r, c, r2, m);
+                    fNext[r][c] = -r2;
+                }
+            }
         }
-      }
-      for (int rep = 0; rep < 5; rep++) {
-        array<double, 4> aux = {0, 0, 0, 0};
-        double sum_coeff = 0;
-        for (auto& cell : cells[i][j]) {
-          int sum_sq = 0;
-          for (int k = 0; k < 4; k++) {
-            sum_sq += sqr(target_colors[cell.second][cell.first][k] - paint_into[i][j][k]);
-          }
-          double coeff = 1.0 / max(1.0, SQRT[sum_sq]);
-          sum_coeff += coeff;
-          for (int k = 0; k < 4; k++) {
-            aux[k] += target_colors[cell.second][cell.first][k] * coeff;
-          }
+    }
+
+    auto [res_pref, idx] = initialMerge();
+    Solution res;
+    res.score = res_pref.score + f[0][0];
+    dp_corners.clear();
+    // the DP priced the floor average of what stays visible; paint the best
+    // color for it instead
+    Palette palette;
+    auto Paint = [&](int r1, int c1, int r2, int c2) {
+        palette.clear();
+        for (int r = r1 * S; r < r2 * S; r++) {
+            palette.add(colors[r] + c1 * S, (c2 - c1) * S);
+        }
+        dp_corners.emplace_back(c1 * S, r1 * S);
+        paintCorner(res.ins, idx, c1 * S, r1 * S, bestFill(palette));
+    };
+    for (int r = 0, c = 0; r < n && c < m;) {
+        int to = fNext[r][c];
+        // walk the chain of the strip; later corners paint over earlier ones
+        int r1 = r, c1 = c, r2 = to > 0 ? n : -to, c2 = to > 0 ? to : m;
+        while (r1 < n && c1 < m) {
+            if (r2 == n && c2 == m) {
+                int next = bothNext[r1 * m + c1];
+                if (next > 0) {
+                    Paint(r1, c1, next, m);
+                    r1 = next;
+                } else {
+                    Paint(r1, c1, n, -next);
+                    c1 = -next;
+                }
+            } else if (r2 == n) {
+                int next = downNext[size_t(downId[c1 * m + c2]) * n + r1];
+                Paint(r1, c1, next, c2);
+                r1 = next;
+            } else {
+                int next = rightNext[size_t(rightId[r1 * n + r2]) * m + c1];
+                Paint(r1, c1, r2, next);
+                c1 = next;
+            }
         }
-        auto old = paint_into[i][j];
-        for (int k = 0; k < 4; k++) {
-          paint_into[i][j][k] = llround(aux[k] / sum_coeff);
+        if (to > 0) {
+            c = to;
+        } else {
+            r = -to;
+        }
+    }
+    res.ins.insert(res.ins.begin(), res_pref.ins.begin(), res_pref.ins.end());
+    std::chrono::duration<double> fs = Time::now() - start_time;
+    msg.clear() << "Result: " << f[0][0] << "\n" << "Duration: " << fs.count() << "s\n";
+    postprocess(res);
+}
+
+// One annealing chain of solveOpt as it stood at the top of an iteration,
+// enough to go on from there exactly. The owners are (0, 0) and then the
+// corners in paint order.
+struct OptChainState {
+    int it = 0, localTries = 0, localI = -1, localJ = -1, bestTotal = 0;
+    double nextMeet = 1;
+    vector<char> rng; // as printed by operator<<
+    vector<double> weights; // region weights row by row, empty in one-by-one mode
+    vector<int> corners; // x, y of each corner
+    vector<int> costs; // per owner
+    vector<Color> fills; // per owner
+    vector<Palette> owned; // per owner
+    vector<int> rects; // the best solution so far, x, y, r, g, b, a per rect
+};
+
+// solveOpt snapshot: OptSnapHeader, the temperature ladder, the states of the
+// meeting and region RNGs, then replicas * workers OptChainStates.
+constexpr char kOptSnapMagic[8] = {'I', 'C', 'P', 'O', 'P', 'T', '0', '1'};
+
+struct OptSnapHeader {
+    char magic[8];
+    int32_t n, mode, replicas, workers, regionOpt, meetRound;
+    uint64_t fingerprint; // of the target, see RectCache
+    double elapsed;
+    float T;
+};
+
+template <class G>
+vector<char> rngState(const G& g) {
+    stringstream ss;
+    ss << g;
+    string s = ss.str();
+    return vector<char>(s.begin(), s.end());
+}
+
+template <class G>
+bool setRngState(G& g, const vector<char>& state) {
+    stringstream ss(string(state.begin(), state.end()));
+    ss >> g;
+    return !ss.fail();
+}
+
+bool writeOptSnapshot(const string& fname, const OptSnapHeader& h, const vector<double>& scale,
+                      const vector<char>& meetRng, const vector<char>& regionRng, const vector<OptChainState>& chains) {
+    return writeAtomically(fname, [&](ostream& out) {
+        writeRaw(out, h);
+        writeRaw(out, scale);
+        writeRaw(out, meetRng);
+        writeRaw(out, regionRng);
+        for (const auto& c : chains) {
+            writeRaw(out, c.it);
+            writeRaw(out, c.localTries);
+            writeRaw(out, c.localI);
+            writeRaw(out, c.localJ);
+            writeRaw(out, c.bestTotal);
+            writeRaw(out, c.nextMeet);
+            writeRaw(out, c.rng);
+            writeRaw(out, c.weights);
+            writeRaw(out, c.corners);
+            writeRaw(out, c.costs);
+            writeRaw(out, c.fills);
+            writeRaw(out, c.rects);
+            for (const auto& pal : c.owned) {
+                writeRaw(out, pal.colors);
+                writeRaw(out, pal.counts);
+            }
+        }
+    });
+}
+
+bool readOptSnapshot(const string& fname, OptSnapHeader& h, vector<double>& scale,
+                     vector<char>& meetRng, vector<char>& regionRng, vector<OptChainState>& chains) {
+    ifstream in(fname, ios::binary);
+    if (!readRaw(in, h) || memcmp(h.magic, kOptSnapMagic, 8) != 0) return false;
+    // every chain needs a telemetry channel
+    const int maxChains = Telemetry::kMaxChannels;
+    if (h.replicas < 1 || h.workers < 1 || h.replicas > maxChains || h.workers > maxChains ||
+        h.replicas * h.workers > maxChains)
+        return false;
+    if (!readRaw(in, scale) || (int) scale.size() != h.replicas) return false;
+    if (!readRaw(in, meetRng) || !readRaw(in, regionRng)) return false;
+    chains.assign(h.replicas * h.workers, OptChainState());
+    for (auto& c : chains) {
+        bool ok = readRaw(in, c.it) && readRaw(in, c.localTries) && readRaw(in, c.localI) && readRaw(in, c.localJ) &&
+                  readRaw(in, c.bestTotal) && readRaw(in, c.nextMeet) && readRaw(in, c.rng) && readRaw(in, c.weights) &&
+                  readRaw(in, c.corners) && readRaw(in, c.costs) && readRaw(in, c.fills) && readRaw(in, c.rects);
+        if (!ok || c.corners.size() % 2 || c.costs.size() != c.corners.size() / 2 + 1 || c.fills.size() != c.costs.size() ||
+            c.rects.size() % 6)
+            return false;
+        for (int x : c.corners)
+            if (x < 0 || x >= h.n) return false;
+        c.owned.resize(c.costs.size());
+        for (auto& pal : c.owned) {
+            vector<Pixel> colors;
+            vector<int> counts;
+            if (!readRaw(in, colors) || !readRaw(in, counts) || colors.size() != counts.size()) return false;
+            pal.restore(move(colors), move(counts));
         }
-        if (paint_into[i][j] == old) {
+    }
+    return true;
+}
+
+void solveOpt() {
+//    solveGena(10, 0);
+    auto init_corners = dp_corners;
+    // loading another test reassigns optSnapshot under a running solveOpt
+    const string snapshot_path = optSnapshot;
+    auto start_time = Time::now();
+    auto GetTime = [&]() {
+      auto cur_time = Time::now();
+      std::chrono::duration<double> fs = cur_time - start_time;
+      return std::chrono::duration_cast<chrono_ms>(fs).count() * 0.001;
+    };
+    msg.clear() << "Running...\n";
+    // Resuming takes the mode, the settings and every chain from the snapshot.
+    OptSnapHeader snap{};
+    vector<double> snap_scale;
+    vector<char> snap_meet_rng, snap_region_rng;
+    vector<OptChainState> resume_chains;
+    bool resume = optResume && readOptSnapshot(snapshot_path, snap, snap_scale, snap_meet_rng, snap_region_rng, resume_chains) &&
+                  snap.n == N && snap.fingerprint == RectCache::fingerprint(colors) && snap.mode >= 0 && snap.mode < 4;
+    if (optResume && !resume) msg << "No snapshot to resume in " << snapshot_path << "\n";
+    optResume = false;
+    if (resume) {
+      start_time -= chrono::duration_cast<Time::duration>(chrono::duration<double>(snap.elapsed));
+      T = snap.T;
+    }
+    auto myColoredBlocks = coloredBlocks;
+    Canvas target_colors = colors;
+    int mode = 0;
+    for (; resume && mode < snap.mode; mode++) {
+      target_colors = target_colors.rotatedClockwise();
+    }
+    while (!resume && mode < 4) {
+      bool ok = true;
+      for (auto& block : myColoredBlocks) {
+        if (block.r2 != N || block.c2 != N) {
+          ok = false;
           break;
         }
       }
-      cost[i][j] = base_cost[i][j];
-      double diff = 0;
-      for (auto& cell : cells[i][j]) {
-        int sum_sq = 0;
-        for (int k = 0; k < 4; k++) {
-          sum_sq += sqr(target_colors[cell.second][cell.first][k] - paint_into[i][j][k]);
-        }
-        diff += SQRT[sum_sq];
+      if (ok) {
+        break;
       }
-      while (true) {
-        bool changed = false;
-        for (int k = 0; k < 4; k++) {
-          for (int delta = -1; delta <= 1; delta += 2) {
-            paint_into[i][j][k] += delta;
-            double new_diff = 0;
-            for (auto& cell : cells[i][j]) {
-              int sum_sq = 0;
-              for (int k = 0; k < 4; k++) {
-                sum_sq += sqr(target_colors[cell.second][cell.first][k] - paint_into[i][j][k]);
-              }
-              new_diff += SQRT[sum_sq];
-            }
-            if (new_diff < diff) {
-              changed = true;
-              diff = new_diff;
-            } else {
-              paint_into[i][j][k] -= delta;
-            }
-          }
-        }
-        if (!changed) {
-          break;
-        }
+      for (auto& block : myColoredBlocks) {
+        swap(block.c1, block.r1);
+        block.c1 = N - block.c1;
+        swap(block.c2, block.r2);
+        block.c2 = N - block.c2;
+        swap(block.c1, block.c2);
       }
-      cost[i][j] += llround(diff * 5);
-      total += cost[i][j];
+      target_colors = target_colors.rotatedClockwise();
+      mode += 1;
+    }
+    cerr << "mode = " << mode << endl;
+    assert(mode < 4);
+    const Canvas cell_colors = target_colors.transposed(); // cell (i, j) at [i][j], so columns are rows
+    int n = N;
+    int m = M;
+    auto merged = initialMerge();
+    auto& res_pref = merged.first;
+    int idx = merged.second;
+    Solution res;
+    res.score = res_pref.score;
+    bool regions = resume ? snap.regionOpt : regionOpt;
+    bool hard = !resume && hardRects;
+    int workers = resume ? snap.workers : regions && !hard ? clamp(regionWorkers, 1, Telemetry::kMaxChannels) : 1;
+    int replicas = resume ? snap.replicas : hard || workers > 1 ? 1 : clamp(optReplicas, 1, Telemetry::kMaxChannels);
+    // Concurrent regions: with regionWorkers > 1 (region mode, one chain) each
+    // worker anneals its own copy of the state. A round gives the workers
+    // regions of one checkerboard class; each logs the moves it kept and the
+    // cells they read. The rounds are then merged in worker order, dropping any
+    // that read a cell an earlier kept round did, and every worker replays the
+    // kept rounds of the others. Kept rounds touch disjoint cells, so they
+    // commute and the copies stay equal; owners recolored by several kept
+    // rounds are priced again.
+    struct RegionRound {
+      vector<pair<pair<int, int>, pair<int, int>>> ops; // corner, the corner it went after, (-1, -1) if removed
+      vector<pair<int, int>> cells; // read by the kept moves
+      vector<tuple<pair<int, int>, int, Color>> owners; // repriced, with their cost and fill after the round
+      bool impr = false;
     };
-    Recalc(0, 0);
-/*    auto ForceSetTop = [&](int i, int j, pair<int, int> new_top) {
-      cells[top[i][j].first][top[i][j].second].erase(iter[i][j]);
-      top[i][j] = new_top;
-      cells[new_top.first][new_top.second].emplace_back(i, j);
-      iter[i][j] = prev(cells[new_top.first][new_top.second].end());
-    };*/
-    auto ForceRecalcTop = [&](int i, int j) {
-      assert(i > 0 || j > 0);
-      auto new_top = (i == 0 ? top[i][j - 1] : (j == 0 ? top[i - 1][j] : Choose(top[i - 1][j], top[i][j - 1])));
-      if (new_top == top[i][j]) {
-        return false;
+    vector<RegionRound> region_rounds(workers);
+    vector<pair<int, int>> region_of(workers); // (-1, -1) if the worker sits the round out
+    vector<bool> region_kept(workers);
+    vector<tuple<pair<int, int>, int, Color>> region_fixed; // owners of exactly one kept round
+    vector<pair<int, int>> region_shared; // owners of several kept rounds
+    vector<vector<double>> region_weights;
+    vector<vector<int>> region_claimed;
+    mt19937 region_rng(time(0));
+    if (resume) setRngState(region_rng, snap_region_rng);
+    bool region_stop = false;
+    float region_T = T; // the temperature for the workers of the round
+    mutex region_mutex;
+    condition_variable region_cv;
+    int region_waiting = 0, region_round = 0;
+    // Runs last() in the last worker to arrive, then lets them all go.
+    auto RegionSync = [&](auto&& last) {
+      unique_lock<mutex> lock(region_mutex);
+      int round = region_round;
+      if (++region_waiting == workers) {
+        last();
+        region_waiting = 0;
+        region_round++;
+        region_cv.notify_all();
+      } else {
+        region_cv.wait(lock, [&] { return region_round != round; });
       }
-      cells[top[i][j].first][top[i][j].second].erase(iter[i][j]);
-      top[i][j] = new_top;
-      cells[new_top.first][new_top.second].emplace_back(i, j);
-      iter[i][j] = prev(cells[new_top.first][new_top.second].end());
-      return true;
     };
-    auto RecalcTop = [&](int i, int j) {
-      if (top[i][j] == make_pair(i, j)) {
-        return false;
+    // Parallel tempering: with optReplicas > 1 that many chains anneal at once,
+    // chain r at T * scale[r], the scales being powers of optLadder. About once
+    // a second the chains meet and neighbouring rungs swap temperatures by the
+    // replica exchange rule, which is the same as swapping their states.
+    // Each chain anneals on its own copy of T: replica 0 takes it from the
+    // global (the UI may move it) and cools it, the others copy it at each
+    // meeting.
+    vector<double> scale(replicas);
+    for (int r = 0; r < replicas; r++) {
+      scale[r] = pow(optLadder, r);
+    }
+    if (resume) scale = snap_scale;
+    vector<int> chain_total(replicas), chain_best(replicas);
+    vector<bool> chain_done(replicas);
+    vector<vector<pair<pair<int, int>, Color>>> chain_rects(replicas);
+    mutex meet_mutex;
+    condition_variable meet_cv;
+    int meet_waiting = 0, meet_active = replicas, meet_round = resume ? snap.meetRound : 0;
+    const float start_T = T;
+    float meet_T = start_T;
+    mt19937 meet_rng(time(0));
+    if (resume) setRngState(meet_rng, snap_meet_rng);
+    // Snapshots: a chain copies its state into chain_states at the top of an
+    // iteration and SaveSnapshot writes all of them. A lone chain does both
+    // every snapshotSeconds; several chains take one at the meeting after it
+    // is due. Each chain also leaves its last state for a final snapshot.
+    vector<OptChainState> chain_states(replicas * workers);
+    bool snapshots = snapshotSeconds > 0 && !hard && !snapshot_path.empty();
+    double next_snapshot = GetTime() + snapshotSeconds;
+    bool snapshot_due = false;
+    auto SaveSnapshot = [&]() {
+      OptSnapHeader h{};
+      memcpy(h.magic, kOptSnapMagic, 8);
+      h.n = N;
+      h.mode = mode;
+      h.replicas = replicas;
+      h.workers = workers;
+      h.regionOpt = regions;
+      h.meetRound = meet_round;
+      h.fingerprint = RectCache::fingerprint(colors);
+      h.elapsed = GetTime();
+      h.T = T;
+      if (!writeOptSnapshot(snapshot_path, h, scale, rngState(meet_rng), rngState(region_rng), chain_states)) {
+        cerr << "Could not save " << snapshot_path << endl;
       }
-      return ForceRecalcTop(i, j);
     };
-    int zzseed = time(0);
-    mt19937 rng(zzseed);
-    uniform_real_distribution<double> urd(0, 1);
-    auto AddCorner = [&](int i, int j, int where) {
-      assert(top[i][j] != make_pair(i, j));
-      if (where == -1) {
-        int L = 0;
-        int R = (int) corners.size();
-        for (int it = 0; it < (int) corners.size(); it++) {
-          if (corners[it].first <= i && corners[it].second <= j) {
-            L = max(L, it + 1);
-          }
-          if (i <= corners[it].first && j <= corners[it].second) {
-            R = min(R, it);
-          }
-        }
-        assert(L <= R);
-        where = L + (rng() % (R - L + 1));
-      }
-      for (int it = where; it < (int) corners.size(); it++) {
-        pos_in_corners[corners[it].first][corners[it].second] += 1;
+    // Run by the last chain to meet: writes the states the chains just took
+    // if a snapshot was due, and tells them whether to take one next time.
+    auto SnapshotMeeting = [&]() {
+      if (snapshot_due) SaveSnapshot();
+      snapshot_due = snapshots && GetTime() >= next_snapshot;
+      if (snapshot_due) next_snapshot = GetTime() + snapshotSeconds;
+    };
+    auto SwapRungs = [&]() {
+      vector<int> rungs;
+      for (int r = 0; r < replicas; r++) {
+        if (!chain_done[r]) rungs.push_back(r);
       }
-      pos_in_corners[i][j] = where;
-      corners.insert(corners.begin() + where, make_pair(i, j));
-      set<pair<int, int>> to_recalc;
-      to_recalc.emplace(i, j);
-      to_recalc.insert(top[i][j]);
-      cells[top[i][j].first][top[i][j].second].erase(iter[i][j]);
-      top[i][j] = make_pair(i, j);
-      cells[i][j].emplace_back(i, j);
-      iter[i][j] = prev(cells[i][j].end());
-      for (int ii = i; ii < N; ii++) {
-        if (ii > i) {
-          auto old = top[ii][j];
-          if (!RecalcTop(ii, j)) {
-            break;
-          }
-          to_recalc.insert(old);
-        }
-        for (int jj = j + 1; jj < N; jj++) {
-          auto old = top[ii][jj];
-          if (!RecalcTop(ii, jj)) {
-            break;
-          }
-          to_recalc.insert(old);
+      sort(rungs.begin(), rungs.end(), [&](int x, int y) { return scale[x] < scale[y]; });
+      for (int k = meet_round % 2; k + 1 < (int) rungs.size(); k += 2) {
+        int x = rungs[k], y = rungs[k + 1];
+        double gap = (1 / scale[x] - 1 / scale[y]) / (10000.0 * meet_T) * (chain_total[x] - chain_total[y]);
+        if (gap >= 0 || exp(gap) > uniform_real_distribution<double>(0, 1)(meet_rng)) {
+          swap(scale[x], scale[y]);
         }
       }
-      for (auto& corner : to_recalc) {
-        Recalc(corner.first, corner.second);
+    };
+    // Waits until every running chain got here, or leaves for good. Staying
+    // chains leave with replica 0's temperature in temp.
+    auto Meet = [&](int replica, int total, float& temp, bool leaving) {
+      unique_lock<mutex> lock(meet_mutex);
+      chain_total[replica] = total;
+      if (replica == 0) meet_T = temp;
+      if (leaving) {
+        chain_done[replica] = true;
+        meet_active--;
+      } else {
+        meet_waiting++;
+      }
+      if (meet_waiting == meet_active) {
+        SnapshotMeeting();
+        if (meet_waiting > 1) SwapRungs();
+        meet_waiting = 0;
+        meet_round++;
+        meet_cv.notify_all();
+      } else if (!leaving) {
+        int round = meet_round;
+        meet_cv.wait(lock, [&] { return meet_round != round; });
       }
+      temp = meet_T;
     };
-    auto RemoveCorner = [&](int i, int j) {
-      assert(top[i][j] == make_pair(i, j));
-      assert(i > 0 || j > 0);
-      int ps = pos_in_corners[i][j];
-      for (int it = ps + 1; it < (int) corners.size(); it++) {
-        pos_in_corners[corners[it].first][corners[it].second] -= 1;
+    auto RunChain = [&](int replica, int worker) {
+      OptChainState* resumed = resume ? &resume_chains[replica * workers + worker] : nullptr;
+      vector<vector<pair<int, int>>> top(N, vector<pair<int, int>>(N));
+      // colors of the cells each corner owns, kept up to date as cells move
+      vector<vector<Palette>> owned(N, vector<Palette>(N));
+      for (int i = 0; i < N; i++) {
+        for (int j = 0; j < N; j++) {
+          top[i][j] = make_pair(0, 0);
+          owned[0][0].add(target_colors[j][i]);
+        }
       }
-      pos_in_corners[i][j] = -1;
-      corners.erase(corners.begin() + ps);
-      set<pair<int, int>> to_recalc;
-      ForceRecalcTop(i, j);
-      to_recalc.insert(top[i][j]);
-      for (int ii = i; ii < N; ii++) {
-        if (ii > i) {
-          if (top[ii][j] != make_pair(i, j) || !RecalcTop(ii, j)) {
-            break;
+      vector<vector<int>> base_cost(N, vector<int>(N));
+      for (int i = 0; i < N; i++) {
+        for (int j = 0; j < N; j++) {
+          base_cost[i][j] = 1000 * PaintCost(N - i, N - j);
+        }
+      }
+      CornerOrder corners;
+      corners.reset(N);
+      // Corners a staged move adds or removes get labels of their own until
+      // it is kept, see StageAdd; real labels count double so that a pending
+      // corner fits between two neighbours.
+      pair<int, int> pending_at[2];
+      long long pending_label[2];
+      int pending_count = 0;
+      auto Priority = [&](pair<int, int> x) {
+        for (int k = 0; k < pending_count; k++)
+          if (pending_at[k] == x) return pending_label[k];
+        return 2LL * corners.label(x);
+      };
+      auto Choose = [&](pair<int, int> x, pair<int, int> y) {
+        auto px = Priority(x);
+        auto py = Priority(y);
+        return (px > py ? x : y);
+      };
+      vector<vector<int>> cost(N, vector<int>(N, 0));
+      vector<vector<Color>> paint_into(N, vector<Color>(N, {-1, -1, -1, -1}));
+      int total = 0;
+      auto Recalc = [&](int i, int j) {
+        total -= cost[i][j];
+        assert(top[i][j] == make_pair(i, j));
+        assert(owned[i][j].total > 0);
+        double diff;
+        paint_into[i][j] = bestFill(owned[i][j], &diff);
+        cost[i][j] = base_cost[i][j];
+        cost[i][j] += llround(diff * 5);
+        total += cost[i][j];
+      };
+      Recalc(0, 0);
+      // A move is staged before it is kept: its first corner order edits stay
+      // pending, new owners of cells go only to staged_top. Settle() prices the
+      // move from the colors each owner gains or loses, then commits it or just
+      // drops it, so a rejected move leaves `corners` untouched. Edits past
+      // what can stay pending go straight to `corners` and are undone.
+      int stage = 1;
+      vector<vector<int>> staged_at(N, vector<int>(N, 0)), priced_at(N, vector<int>(N, 0));
+      vector<vector<pair<int, int>>> staged_top(N, vector<pair<int, int>>(N));
+      vector<pair<int, int>> staged_cells;
+      vector<tuple<pair<int, int>, int, pair<int, int>>> staged_order; // corner, its position before or -1, the corner it went after
+      vector<tuple<pair<int, int>, int, pair<int, int>>> pending_order; // the same, not yet in `corners`
+      vector<pair<int, int>> staged_reads; // only kept with several region workers
+      vector<tuple<pair<int, int>, int, Color>> staged_costs;
+      vector<vector<int>> delta_of(N, vector<int>(N));
+      vector<Palette> deltas; // colors an owner gains (> 0) or loses (< 0)
+      bool priced = false;
+      int staged_delta = 0;
+      auto Top = [&](int i, int j) {
+        if (workers > 1) staged_reads.emplace_back(i, j);
+        return staged_at[i][j] == stage ? staged_top[i][j] : top[i][j];
+      };
+      auto SetTop = [&](int i, int j, pair<int, int> new_top) {
+        if (staged_at[i][j] != stage) {
+          staged_at[i][j] = stage;
+          staged_cells.emplace_back(i, j);
+        }
+        staged_top[i][j] = new_top;
+      };
+      // Calls f(was, now, color, len) for each run of len staged cells in one
+      // column that move between the same owners and share a color. Cells are
+      // staged column by column, so flat areas move a run at a time.
+      auto MovedRuns = [&](auto&& f) {
+        for (size_t k = 0, cnt = staged_cells.size(); k < cnt;) {
+          auto [i, j] = staged_cells[k];
+          auto* was = &top[i][j];
+          auto* now = &staged_top[i][j];
+          auto* color = cell_colors[i] + j;
+          int len = 1;
+          if (*was != *now) {
+            while (k + len < cnt && staged_cells[k + len] == make_pair(i, j + len) && was[len] == *was &&
+                   now[len] == *now && color[len] == *color)
+              len++;
+            f(*was, *now, *color, len);
+          }
+          k += len;
+        }
+      };
+      auto Price = [&]() {
+        int used = 0;
+        auto DeltaOf = [&](pair<int, int> o) -> Palette& {
+          if (priced_at[o.first][o.second] != stage) {
+            priced_at[o.first][o.second] = stage;
+            if (used == (int) deltas.size()) deltas.emplace_back();
+            deltas[used].clear();
+            delta_of[o.first][o.second] = used++;
+            staged_costs.emplace_back(o, 0, paint_into[o.first][o.second]);
+          }
+          return deltas[delta_of[o.first][o.second]];
+        };
+        MovedRuns([&](pair<int, int> was, pair<int, int> now, const Pixel& color, int len) {
+          DeltaOf(was).add(color, -len);
+          DeltaOf(now).add(color, len);
+        });
+        staged_delta = 0;
+        for (auto& [o, new_cost, fill] : staged_costs) {
+          auto& delta = deltas[delta_of[o.first][o.second]];
+          if (owned[o.first][o.second].total + delta.total > 0) {
+            double diff;
+            // an owner that keeps cells starts from its current fill
+            auto from = owned[o.first][o.second].total > 0 ? &paint_into[o.first][o.second] : nullptr;
+            fill = bestFill(owned[o.first][o.second], &delta, &diff, from);
+            new_cost = base_cost[o.first][o.second] + llround(diff * 5);
+          }
+          staged_delta += new_cost - cost[o.first][o.second];
+        }
+        priced = true;
+        return staged_delta;
+      };
+      // Makes the pending order edits real; the corners keep their order, so
+      // tops staged against the pending labels stay right.
+      auto Materialize = [&]() {
+        if (pending_order.empty()) return;
+        for (auto& op : pending_order) {
+          auto& [c, pos, after] = op;
+          if (pos != -1) corners.erase(c);
+          else corners.insert(after == make_pair(0, 0) ? 0 : corners.position(after) + 1, c);
+          staged_order.push_back(op);
+        }
+        pending_order.clear();
+        pending_count = 0;
+      };
+      auto NextStage = [&]() {
+        staged_cells.clear();
+        staged_order.clear();
+        pending_order.clear();
+        pending_count = 0;
+        staged_costs.clear();
+        staged_reads.clear();
+        priced = false;
+        stage++;
+      };
+      // This worker's part of the current region round, see RegionRound.
+      int sync_round = 0;
+      vector<vector<int>> read_in(workers > 1 ? N : 0, vector<int>(N, -1)), priced_in(read_in);
+      vector<pair<pair<int, int>, int>> round_undo; // corner, its position before or -1
+      vector<tuple<pair<int, int>, int, Color>> round_before; // owners' cost and fill before the round
+      auto Keep = [&]() {
+        auto& round = region_rounds[worker];
+        auto Read = [&](pair<int, int> c) {
+          if (read_in[c.first][c.second] != sync_round) {
+            read_in[c.first][c.second] = sync_round;
+            round.cells.push_back(c);
+          }
+        };
+        for (auto c : staged_reads) Read(c);
+        for (auto& [c, pos, after] : staged_order) {
+          Read(c);
+          if (pos == -1) Read(after);
+          round.ops.emplace_back(c, pos == -1 ? after : make_pair(-1, -1));
+          round_undo.emplace_back(c, pos);
+        }
+        for (auto& [o, new_cost, fill] : staged_costs) {
+          if (priced_in[o.first][o.second] != sync_round) {
+            priced_in[o.first][o.second] = sync_round;
+            round_before.emplace_back(o, cost[o.first][o.second], paint_into[o.first][o.second]);
+          }
+        }
+      };
+      auto Commit = [&]() {
+        if (!priced) Price();
+        Materialize();
+        if (workers > 1) Keep();
+        for (auto [i, j] : staged_cells)
+          top[i][j] = staged_top[i][j];
+        for (auto& [o, new_cost, fill] : staged_costs) {
+          auto& pal = owned[o.first][o.second];
+          auto& delta = deltas[delta_of[o.first][o.second]];
+          for (size_t k = 0; k < delta.colors.size(); k++)
+            if (delta.counts[k] != 0) pal.add(delta.colors[k], delta.counts[k]);
+          if (pal.total == 0) pal = Palette();
+          cost[o.first][o.second] = new_cost;
+          paint_into[o.first][o.second] = fill;
+        }
+        total += staged_delta;
+        NextStage();
+      };
+      // Commits the staged tops and colors for moves priced elsewhere; the
+      // caller sets the owners' costs.
+      auto Apply = [&]() {
+        Materialize();
+        MovedRuns([&](pair<int, int> was, pair<int, int> now, const Pixel& color, int len) {
+          owned[was.first][was.second].add(color, -len);
+          owned[now.first][now.second].add(color, len);
+        });
+        for (auto [i, j] : staged_cells)
+          top[i][j] = staged_top[i][j];
+        NextStage();
+      };
+      auto Discard = [&]() {
+        for (int k = (int) staged_order.size() - 1; k >= 0; k--) {
+          auto [c, pos, after] = staged_order[k];
+          if (pos == -1) corners.erase(c);
+          else corners.insert(pos, c);
+        }
+        NextStage();
+      };
+      auto ForceRecalcTop = [&](int i, int j) {
+        assert(i > 0 || j > 0);
+        auto new_top = (i == 0 ? Top(i, j - 1) : (j == 0 ? Top(i - 1, j) : Choose(Top(i - 1, j), Top(i, j - 1))));
+        if (new_top == Top(i, j)) {
+          return false;
+        }
+        SetTop(i, j, new_top);
+        return true;
+      };
+      auto RecalcTop = [&](int i, int j) {
+        if (Top(i, j) == make_pair(i, j)) {
+          return false;
+        }
+        return ForceRecalcTop(i, j);
+      };
+      int zzseed = time(0) + replica + worker;
+      mt19937 rng(zzseed);
+      uniform_real_distribution<double> urd(0, 1);
+      auto Tentative = [&](pair<int, int> c, long long label) {
+        int k = 0;
+        while (k < pending_count && pending_at[k] != c) k++;
+        if (k == pending_count) pending_at[pending_count++] = c;
+        pending_label[k] = label;
+      };
+      // The first edit of a move, or an add right after its one removal, stays
+      // pending: the new corner is labeled just past the corner it goes after.
+      auto StageAdd = [&](int i, int j, int where) {
+        assert(Top(i, j) != make_pair(i, j));
+        // position of a pending removal; later positions shift down by one
+        int gone = INT_MAX;
+        if (staged_order.empty() && pending_order.size() == 1) {
+          auto& [c, pos, after] = pending_order[0];
+          if (pos != -1 && (where != -1 || c == make_pair(i, j))) gone = pos;
+        }
+        bool pending = staged_order.empty() && (pending_order.empty() || gone != INT_MAX);
+        if (!pending) Materialize();
+        if (where == -1) {
+          auto [L, R] = corners.window(make_pair(i, j));
+          if (gone != INT_MAX) R--; // the corner itself is still in the order
+          assert(L <= R);
+          where = L + (rng() % (R - L + 1));
+        }
+        if (pending) {
+          auto after = where == 0 ? make_pair(0, 0) : corners[where - 1 < gone ? where - 1 : where];
+          pending_order.emplace_back(make_pair(i, j), -1, after);
+          Tentative(make_pair(i, j), where == 0 ? -1 : Priority(after) + 1);
+        } else {
+          auto after = workers > 1 && where > 0 ? corners[where - 1] : make_pair(0, 0);
+          corners.insert(where, make_pair(i, j));
+          staged_order.emplace_back(make_pair(i, j), -1, after);
+        }
+        SetTop(i, j, make_pair(i, j));
+        // A top is the latest corner dominating its cell, so the new corner
+        // takes exactly the cells it dominates whose top is earlier; along a
+        // column those are a prefix from row j, and a column that takes none
+        // ends the walk.
+        auto label = Priority(make_pair(i, j));
+        auto Takes = [&](int ii, int jj) {
+          auto t = Top(ii, jj);
+          return t != make_pair(ii, jj) && Priority(t) < label;
+        };
+        for (int ii = i; ii < N; ii++) {
+          if (ii > i) {
+            if (!Takes(ii, j)) break;
+            SetTop(ii, j, make_pair(i, j));
+          }
+          for (int jj = j + 1; jj < N && Takes(ii, jj); jj++) {
+            SetTop(ii, jj, make_pair(i, j));
           }
-          to_recalc.insert(top[ii][j]);
         }
-        for (int jj = j + 1; jj < N; jj++) {
-          if (top[ii][jj] != make_pair(i, j) || !RecalcTop(ii, jj)) {
+      };
+      auto StageRemove = [&](int i, int j) {
+        assert(Top(i, j) == make_pair(i, j));
+        assert(i > 0 || j > 0);
+        if (staged_order.empty() && pending_order.empty()) {
+          pending_order.emplace_back(make_pair(i, j), corners.position(make_pair(i, j)), make_pair(0, 0));
+          Tentative(make_pair(i, j), -2);
+        } else {
+          Materialize();
+          staged_order.emplace_back(make_pair(i, j), corners.position(make_pair(i, j)), make_pair(0, 0));
+          corners.erase(make_pair(i, j));
+        }
+        ForceRecalcTop(i, j);
+        for (int ii = i; ii < N; ii++) {
+          if (ii > i && (Top(ii, j) != make_pair(i, j) || !RecalcTop(ii, j))) {
             break;
           }
-          to_recalc.insert(top[ii][jj]);
+          for (int jj = j + 1; jj < N; jj++) {
+            if (Top(ii, jj) != make_pair(i, j) || !RecalcTop(ii, jj)) {
+              break;
+            }
+          }
+        }
+      };
+      auto& tele = telemetry.channel(replica * workers + worker);
+      float temp = start_T;
+      // Keeps the staged move by the annealing rule, undoing it otherwise, and
+      // reports it to the chain's telemetry channel.
+      auto Settle = [&](int type) {
+        int delta = Price();
+        if (delta <= 0 || exp(-delta / 10000.0 / (temp * scale[replica])) > urd(rng)) {
+          Commit();
+          tele.move(type, true, delta, total);
+          return true;
+        }
+        Discard();
+        tele.move(type, false, delta, total);
+        return false;
+      };
+      auto AddCorner = [&](int i, int j, int where) {
+        StageAdd(i, j, where);
+        Commit();
+      };
+      auto RemoveCorner = [&](int i, int j) {
+        StageRemove(i, j);
+        Commit();
+      };
+      cerr << "total = " << res.score + total << endl;
+      if (resumed) {
+        for (size_t k = 0; k < resumed->corners.size(); k += 2) {
+          AddCorner(resumed->corners[k], resumed->corners[k + 1], (int) corners.size());
+        }
+      } else for (auto& block : myColoredBlocks) {
+        if ((block.r1 > 0 || block.c1 > 0) && top[block.c1][block.r1] != make_pair(block.c1, block.r1)) {
+          AddCorner(block.c1, block.r1, (int) corners.size());
         }
       }
-      for (auto& corner : to_recalc) {
-        Recalc(corner.first, corner.second);
+      cerr << "total = " << res.score + total << endl;
+  //    for (int i = 0; i < N; i += 40) for (int j = 0; j < N; j += 40) if (i > 0 || j > 0) AddCorner(i, j);
+      #define setlocal localTries = 100; localI = i; localJ = j;
+      int localTries = 0;
+      int localI = -1, localJ = -1;
+      vector<pair<pair<int, int>, Color>> rects;
+      rects.emplace_back(make_pair(0, 0), paint_into[0][0]);
+      for (auto& p : corners) {
+        rects.emplace_back(p, paint_into[p.first][p.second]);
       }
-      total -= cost[i][j];
-      cost[i][j] = 0;
-    };
-    auto [res_pref, idx] = initialMerge();
-    Solution res;
-    res.score = res_pref.score;
-    cerr << "total = " << res.score + total << endl;
-    for (auto& block : myColoredBlocks) {
-      if ((block.r1 > 0 || block.c1 > 0) && top[block.c1][block.r1] != make_pair(block.c1, block.r1)) {
-        AddCorner(block.c1, block.r1, (int) corners.size());
+      int best_total = total;
+      double next_meet = 1;
+      int first_it = 0;
+      if (resumed) {
+        // the saved palettes and prices, which AddCorner need not match to the last bit
+        size_t k = 0;
+        auto Restore = [&](pair<int, int> o) {
+          owned[o.first][o.second] = move(resumed->owned[k]);
+          total += resumed->costs[k] - cost[o.first][o.second];
+          cost[o.first][o.second] = resumed->costs[k];
+          paint_into[o.first][o.second] = resumed->fills[k++];
+        };
+        Restore(make_pair(0, 0));
+        for (auto& c : corners) Restore(c);
+        rects.clear();
+        for (size_t r = 0; r < resumed->rects.size(); r += 6) {
+          auto* v = &resumed->rects[r];
+          rects.emplace_back(make_pair(v[0], v[1]), Color{v[2], v[3], v[4], v[5]});
+        }
+        best_total = resumed->bestTotal;
+        localTries = resumed->localTries;
+        localI = resumed->localI;
+        localJ = resumed->localJ;
+        next_meet = resumed->nextMeet;
+        first_it = resumed->it;
+        setRngState(rng, resumed->rng);
+        cerr << "resumed at it " << first_it << ", total = " << res.score + total / 1000 << endl;
       }
-    }
-    cerr << "total = " << res.score + total << endl;
-//    for (int i = 0; i < N; i += 40) for (int j = 0; j < N; j += 40) if (i > 0 || j > 0) AddCorner(i, j);
-    int qit = 0;
-    #define wlog(operationType) msg.clear() << "it " << it << "|" << qit << " [" << operationType << "] cnt: " << corners.size() \
-            << ", total: " << res.score + total / 1000 << " (" << res.score << "+" << total / 1000.0 << "), best: " << res.score + best_total / 1000 << ", time: " << GetTime() << + "s\n"
-    #define setlocal localTries = 100; localI = i; localJ = j;
-    int localTries = 0;
-    int localI = -1, localJ = -1;
-    vector<pair<pair<int, int>, Color>> rects;
-    rects.emplace_back(make_pair(0, 0), paint_into[0][0]);
-    for (auto& p : corners) {
-      rects.emplace_back(p, paint_into[p.first][p.second]);
-    }
-    int best_total = total;
-
-    auto optimizeHard = [&](int r1, int c1, int r2, int c2, int maxIters) {
-        int start_total = total;
-        vector<pair<pair<int, int>, int>> save;
-        for (int i = r1; i < r2; i++)
-            for (int j = c1; j < c2; j++)
-                if (top[i][j] == make_pair(i, j)) {
-                    save.emplace_back(top[i][j], pos_in_corners[i][j]);
-                    RemoveCorner(i, j);
-                }
+      auto Snapshot = [&](int it, const vector<vector<double>>& weights) {
+        auto& st = chain_states[replica * workers + worker];
+        st = OptChainState();
+        st.it = it;
+        st.localTries = localTries;
+        st.localI = localI;
+        st.localJ = localJ;
+        st.bestTotal = best_total;
+        st.nextMeet = next_meet;
+        st.rng = rngState(rng);
+        for (auto& row : weights) st.weights.insert(st.weights.end(), row.begin(), row.end());
+        auto Save = [&](pair<int, int> o) {
+          st.costs.push_back(cost[o.first][o.second]);
+          st.fills.push_back(paint_into[o.first][o.second]);
+          st.owned.push_back(owned[o.first][o.second]);
+        };
+        Save(make_pair(0, 0));
+        for (auto& c : corners) {
+          st.corners.push_back(c.first);
+          st.corners.push_back(c.second);
+          Save(c);
+        }
+        for (auto& [c, color] : rects) {
+          st.rects.insert(st.rects.end(), {c.first, c.second, color[0], color[1], color[2], color[3]});
+        }
+      };
+      // Takes and writes a snapshot when due, for a lone chain.
+      auto Checkpoint = [&](int it, const vector<vector<double>>& weights) {
+        if (snapshots && replicas * workers == 1 && GetTime() >= next_snapshot) {
+          Snapshot(it, weights);
+          SaveSnapshot();
+          next_snapshot = GetTime() + snapshotSeconds;
+        }
+      };
+
+      auto optimizeHard = [&](int r1, int c1, int r2, int c2, int maxIters) {
+          int start_total = total;
+          vector<pair<pair<int, int>, int>> save;
+          for (int i = r1; i < r2; i++)
+              for (int j = c1; j < c2; j++)
+                  if (top[i][j] == make_pair(i, j)) {
+                      save.emplace_back(top[i][j], corners.position(top[i][j]));
+                      RemoveCorner(i, j);
+                  }
 
-        if (save.empty()) return false;
+          if (save.empty()) return false;
 
-        for (int i = r1; i < r2; i++)
-            for (int j = c1; j < c2; j++)
-                if (rng() % 7 == 0) {
-                    AddCorner(i, j, -1);
-                }
+          for (int i = r1; i < r2; i++)
+              for (int j = c1; j < c2; j++)
+                  if (rng() % 7 == 0) {
+                      AddCorner(i, j, -1);
+                  }
 
-        drawR1 = r1;
-        drawR2 = r2;
-        drawC1 = c1;
-        drawC2 = c2;
-        cerr << "optimizeHard " << r1 << "," << c1 << " - " << r2 << "," << c2 << ", " << save.size() << " removed:\n";
-        cerr << start_total / 1000.0 << " -> " << total / 1000.0;
-        // best_total = 1e9;
-
-        for (int it = 0; it < maxIters && optRunning; it++) {
-          if (total < best_total) {
-            best_total = total;
-            rects.clear();
-            rects.emplace_back(make_pair(0, 0), paint_into[0][0]);
-            for (auto& p : corners) {
-              rects.emplace_back(p, paint_into[p.first][p.second]);
+          drawR1 = r1;
+          drawR2 = r2;
+          drawC1 = c1;
+          drawC2 = c2;
+          cerr << "optimizeHard " << r1 << "," << c1 << " - " << r2 << "," << c2 << ", " << save.size() << " removed:\n";
+          cerr << start_total / 1000.0 << " -> " << total / 1000.0;
+          // best_total = 1e9;
+
+          for (int it = 0; it < maxIters && optRunning; it++) {
+            if (total < best_total) {
+              best_total = total;
+              rects.clear();
+              rects.emplace_back(make_pair(0, 0), paint_into[0][0]);
+              for (auto& p : corners) {
+                rects.emplace_back(p, paint_into[p.first][p.second]);
+              }
             }
-          }
+            tele.iterate(it, GetTime(), total, best_total, (int) corners.size());
 
-          T = (1 - double(it) / maxIters) * (1 - double(it) / maxIters) * (1 - double(it) / maxIters);
-
-          vector<int> cidsInRegion;
-          for (size_t id = 0; id < corners.size(); id++)
-            if (r1 <= corners[id].first && corners[id].first < r2 &&
-                c1 <= corners[id].second && corners[id].second < c2) {
-                cidsInRegion.push_back(id);
-            }
-          // cerr << cidsInRegion.size() << "...";
-
-          if (corners.size() >= 2 && !cidsInRegion.empty()) {
-            int id = cidsInRegion[rng() % (int)cidsInRegion.size()];
-            int i = corners[id].first;
-            int j = corners[id].second;
-            bool bad = false;
-            if (!bad) {
-                auto old_total = total;
-                RemoveCorner(i, j);
-                AddCorner(i, j, -1);
-                if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-                  wlog("SWP");
-                } else {
-                  RemoveCorner(i, j);
-                  AddCorner(i, j, id);
-                }
+            temp = (1 - double(it) / maxIters) * (1 - double(it) / maxIters) * (1 - double(it) / maxIters);
+            T = temp;
+
+            vector<int> cidsInRegion;
+            int cid = 0;
+            for (auto& c : corners) {
+              if (r1 <= c.first && c.first < r2 && c1 <= c.second && c.second < c2) {
+                  cidsInRegion.push_back(cid);
+              }
+              cid++;
+            }
+            // cerr << cidsInRegion.size() << "...";
+
+            if (corners.size() >= 2 && !cidsInRegion.empty()) {
+              int id = cidsInRegion[rng() % (int)cidsInRegion.size()];
+              int i = corners[id].first;
+              int j = corners[id].second;
+              bool bad = false;
+              if (!bad) {
+                  StageRemove(i, j);
+                  StageAdd(i, j, -1);
+                  Settle(kMoveSwp);
+              }
             }
-          }
-          if (!corners.empty() && !cidsInRegion.empty()) {
-            int id = cidsInRegion[rng() % (int)cidsInRegion.size()];
-            int i = corners[id].first;
-            int j = corners[id].second;
-            { // MOV
-                for (int di = -1; di <= 1; di++)
-                    for (int dj = -1; dj <= 1; dj++)
-                        if (di != 0 || dj != 0) {
-                          int ni = i + di;
-                          int nj = j + dj;
-                          if (ni < r1 || nj < c1 || ni >= r2 || nj >= c2 || top[ni][nj] == make_pair(ni, nj) || (ni == 0 && nj == 0))
-                            continue;
-                          {
-                            int L = 0;
-                            int R = (int) corners.size();
-                            for (int it = 0; it < (int) corners.size(); it++) {
-                              if (corners[it].first <= ni && corners[it].second <= nj) {
-                                L = max(L, it + 1);
-                              }
-                              if (ni <= corners[it].first && nj <= corners[it].second) {
-                                R = min(R, it);
+            if (!corners.empty() && !cidsInRegion.empty()) {
+              int id = cidsInRegion[rng() % (int)cidsInRegion.size()];
+              int i = corners[id].first;
+              int j = corners[id].second;
+              { // MOV
+                  for (int di = -1; di <= 1; di++)
+                      for (int dj = -1; dj <= 1; dj++)
+                          if (di != 0 || dj != 0) {
+                            int ni = i + di;
+                            int nj = j + dj;
+                            if (ni < r1 || nj < c1 || ni >= r2 || nj >= c2 || top[ni][nj] == make_pair(ni, nj) || (ni == 0 && nj == 0))
+                              continue;
+                            {
+                              auto [L, R] = corners.window(make_pair(ni, nj));
+                              if (L > id || id > R) {
+                                  continue;
                               }
                             }
-                            if (L > id || id > R) {
-                                continue;
+                            StageRemove(i, j);
+                            StageAdd(ni, nj, id);
+                            if (Settle(kMoveMov)) {
+                              setlocal
+                              i = ni;
+                              j = nj;
                             }
-                          }
-                          auto old_total = total;
-                          RemoveCorner(i, j);
-                          AddCorner(ni, nj, id);
-                          if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-                            wlog("MOV");
-                            setlocal
-                            i = ni;
-                            j = nj;
-                          } else {
-                            RemoveCorner(ni, nj);
-                            AddCorner(i, j, id);
-                          }
-                      }
-            }
-          }
-
-          int i, j;
-          { // ADD
-            do {
-                i = r1 + rng() % (r2 - r1);
-                j = c1 + rng() % (c2 - c1);
-            } while (top[i][j] == make_pair(i, j));
-            // if (localTries > 0) localTries--;
-            auto old_total = total;
-            AddCorner(i, j, -1);
-            if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-              wlog("ADD");
-              setlocal
-            } else {
-              RemoveCorner(i, j);
+                        }
+              }
             }
-          }
 
-          if (!cidsInRegion.empty()) { // REM
-            int id = cidsInRegion[rng() % (int)cidsInRegion.size()];
-            i = corners[id].first;
-            j = corners[id].second;
-            auto old_total = total;
-            RemoveCorner(i, j);
-            if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-              wlog("REM");
-              setlocal
-            } else {
-              AddCorner(i, j, id);
+            int i, j;
+            { // ADD
+              do {
+                  i = r1 + rng() % (r2 - r1);
+                  j = c1 + rng() % (c2 - c1);
+              } while (top[i][j] == make_pair(i, j));
+              // if (localTries > 0) localTries--;
+              StageAdd(i, j, -1);
+              if (Settle(kMoveAdd)) {
+                setlocal
+              }
             }
-          }
-        }
-
-        cerr << " -> " << total / 1000.0 << endl;
-        /*if (start_total < total) {
-            for (int i = r1; i < r2; i++)
-                for (int j = c1; j < c2; j++)
-                    if (top[i][j] == make_pair(i, j)) {
-                        RemoveCorner(i, j);
-                    }
-            reverse(save.begin(), save.end());
-            for (auto [c, id] : save)
-                AddCorner(c.first, c.second, id);
-        }*/
-        return true;
-    };
 
-    auto optimizeOneByOne = [&]() {
-        for (int it = 0; it < 100000000; it++) {
-          if (total < best_total) {
-            best_total = total;
-            rects.clear();
-            rects.emplace_back(make_pair(0, 0), paint_into[0][0]);
-            for (auto& p : corners) {
-              rects.emplace_back(p, paint_into[p.first][p.second]);
+            if (!cidsInRegion.empty()) { // REM
+              int id = cidsInRegion[rng() % (int)cidsInRegion.size()];
+              i = corners[id].first;
+              j = corners[id].second;
+              StageRemove(i, j);
+              if (Settle(kMoveRem)) {
+                setlocal
+              }
             }
           }
-          if (GetTime() > optSeconds || !optRunning) {
-            break;
-          }
-
-          if (hardMove) {
-            hardMove = false;
-            int id = rng() % (int) corners.size();
-            int i = corners[id].first;
-            int j = corners[id].second;
-            vector<pair<pair<int, int>, int>> toMove;
-            for (size_t cc = 0; cc < corners.size(); cc++)
-                if (abs(corners[cc].first - i) < 42 && abs(corners[cc].second - j) < 42) {
-                    toMove.emplace_back(corners[cc], cc);
-                }
-            if (toMove.size() > 5) toMove.resize(5);
-            for (auto [p, id] : toMove) {
-                auto [ii, jj] = p;
-                RemoveCorner(ii, jj);
-                ii += rng() % 11 - 5;
-                jj += rng() % 11 - 5;
-                if (ii < 0) ii = 0;
-                if (ii >= N) ii = N -1;
-                if (jj < 0) jj = 0;
-                if (jj >= N) jj = N - 1;
-                AddCorner(ii, jj, id);
-            }
-            cerr << "Moved " << toMove.size() << ", total: " << total << endl;
-          }
 
-          if (it % 100 == 0) {
-            T = T * 0.9999;
-          }
-          if (corners.size() >= 2) {
-            int id = rng() % (int) corners.size();
-            int i = corners[id].first;
-            int j = corners[id].second;
-            bool bad = false;
-            if (localTries > 0) {
-                localTries--;
-                if (abs(i - localI) > 40 || abs(j - localJ) > 40) {
-                    bad = true;
-                }
+          cerr << " -> " << total / 1000.0 << endl;
+          /*if (start_total < total) {
+              for (int i = r1; i < r2; i++)
+                  for (int j = c1; j < c2; j++)
+                      if (top[i][j] == make_pair(i, j)) {
+                          RemoveCorner(i, j);
+                      }
+              reverse(save.begin(), save.end());
+              for (auto [c, id] : save)
+                  AddCorner(c.first, c.second, id);
+          }*/
+          return true;
+      };
+
+      auto optimizeOneByOne = [&]() {
+          for (int it = first_it; it < 100000000; it++) {
+            if (total < best_total) {
+              best_total = total;
+              rects.clear();
+              rects.emplace_back(make_pair(0, 0), paint_into[0][0]);
+              for (auto& p : corners) {
+                rects.emplace_back(p, paint_into[p.first][p.second]);
+              }
             }
-            if (!bad) {
-                auto old_total = total;
-                RemoveCorner(i, j);
-                AddCorner(i, j, -1);
-                if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-                  wlog("SWP");
-                  setlocal
-                } else {
-                  RemoveCorner(i, j);
-                  AddCorner(i, j, id);
-                }
+            tele.iterate(it, GetTime(), total, best_total, (int) corners.size());
+            if (replicas > 1 && GetTime() >= next_meet) {
+              if (snapshot_due) Snapshot(it, {});
+              Meet(replica, total, temp, false);
+              next_meet += 1;
             }
-          }
-          if (!corners.empty()) {
-            int id = rng() % (int) corners.size();
-            int i = corners[id].first;
-            int j = corners[id].second;
-            bool bad = false;
-            if (localTries > 0) {
-                localTries--;
-                if (abs(i - localI) > 40 || abs(j - localJ) > 40) {
-                    bad = true;
-                }
+            Checkpoint(it, {});
+            if (GetTime() > optSeconds || !optRunning) {
+              if (snapshots) Snapshot(it, {});
+              break;
+            }
+
+            if (replica == 0 && hardMove) {
+              hardMove = false;
+              int id = rng() % (int) corners.size();
+              int i = corners[id].first;
+              int j = corners[id].second;
+              vector<pair<pair<int, int>, int>> toMove;
+              int cc = 0;
+              for (auto& c : corners) {
+                  if (abs(c.first - i) < 42 && abs(c.second - j) < 42) {
+                      toMove.emplace_back(c, cc);
+                  }
+                  cc++;
+              }
+              if (toMove.size() > 5) toMove.resize(5);
+              for (auto [p, id] : toMove) {
+                  auto [ii, jj] = p;
+                  RemoveCorner(ii, jj);
+                  ii += rng() % 11 - 5;
+                  jj += rng() % 11 - 5;
+                  if (ii < 0) ii = 0;
+                  if (ii >= N) ii = N -1;
+                  if (jj < 0) jj = 0;
+                  if (jj >= N) jj = N - 1;
+                  AddCorner(ii, jj, id);
+              }
+              cerr << "Moved " << toMove.size() << ", total: " << total << endl;
+            }
+
+            if (replica == 0 && it % 100 == 0) {
+              temp = T * 0.9999f;
+              T = temp;
+            }
+            if (corners.size() >= 2) {
+              int id = rng() % (int) corners.size();
+              int i = corners[id].first;
+              int j = corners[id].second;
+              bool bad = false;
+              if (localTries > 0) {
+                  localTries--;
+                  if (abs(i - localI) > 40 || abs(j - localJ) > 40) {
+                      bad = true;
+                  }
+              }
+              if (!bad) {
+                  StageRemove(i, j);
+                  StageAdd(i, j, -1);
+                  if (Settle(kMoveSwp)) {
+                    setlocal
+                  }
+              }
             }
-            if (!bad) {
-                for (int di = -1; di <= 1; di++)
-                    for (int dj = -1; dj <= 1; dj++)
-                        if (di != 0 || dj != 0) {
-                          int ni = i + di;
-                          int nj = j + dj;
-                          if (ni < 0 || nj < 0 || ni >= N || nj >= N || top[ni][nj] == make_pair(ni, nj) || (ni == 0 && nj == 0))
-                            continue;
-                          {
-                            int L = 0;
-                            int R = (int) corners.size();
-                            for (int it = 0; it < (int) corners.size(); it++) {
-                              if (corners[it].first <= ni && corners[it].second <= nj) {
-                                L = max(L, it + 1);
-                              }
-                              if (ni <= corners[it].first && nj <= corners[it].second) {
-                                R = min(R, it);
+            if (!corners.empty()) {
+              int id = rng() % (int) corners.size();
+              int i = corners[id].first;
+              int j = corners[id].second;
+              bool bad = false;
+              if (localTries > 0) {
+                  localTries--;
+                  if (abs(i - localI) > 40 || abs(j - localJ) > 40) {
+                      bad = true;
+                  }
+              }
+              if (!bad) {
+                  for (int di = -1; di <= 1; di++)
+                      for (int dj = -1; dj <= 1; dj++)
+                          if (di != 0 || dj != 0) {
+                            int ni = i + di;
+                            int nj = j + dj;
+                            if (ni < 0 || nj < 0 || ni >= N || nj >= N || top[ni][nj] == make_pair(ni, nj) || (ni == 0 && nj == 0))
+                              continue;
+                            {
+                              auto [L, R] = corners.window(make_pair(ni, nj));
+                              if (L > id || id > R) {
+                                  continue;
                               }
                             }
-                            if (L > id || id > R) {
-                                continue;
+                            StageRemove(i, j);
+                            StageAdd(ni, nj, id);
+                            if (Settle(kMoveMov)) {
+                              setlocal
+                              i = ni;
+                              j = nj;
                             }
-                          }
-                          auto old_total = total;
-                          RemoveCorner(i, j);
-                          AddCorner(ni, nj, id);
-                          if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-                            wlog("MOV");
-                            setlocal
-                            i = ni;
-                            j = nj;
-                          } else {
-                            RemoveCorner(ni, nj);
-                            AddCorner(i, j, id);
-                          }
-                      }
+                        }
+              }
             }
-          }
 
-          int i, j, si, sj;
-          { // ADD
-            do {
-              // qit++;
-              // i = qit % (N * N) / N;
-              // j = qit % N;
-                i = rng() % N;
-                j = rng() % N;
-                si = rng() % 20 + 1;
-                sj = rng() % 20 + 1;
-            } while (top[i][j] == make_pair(i, j) || i + si >= N || j + sj >= N || top[i+si][j] == make_pair(i+si, j) || top[i][j+sj] == make_pair(i, j+sj) || (localTries > 0 && (abs(i - localI) > 20 || abs(j - localJ) > 20)));
-            // if (localTries > 0) localTries--;
-            auto old_total = total;
-            AddCorner(i, j, -1);
-            AddCorner(i+si, j, -1);
-            AddCorner(i, j+sj, -1);
-            if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-              wlog("ADD");
-              setlocal
-            } else {
-              RemoveCorner(i, j);
-              RemoveCorner(i+si, j);
-              RemoveCorner(i, j+sj);
+            int i, j, si, sj;
+            { // ADD
+              do {
+                // qit++;
+                // i = qit % (N * N) / N;
+                // j = qit % N;
+                  i = rng() % N;
+                  j = rng() % N;
+                  si = rng() % 20 + 1;
+                  sj = rng() % 20 + 1;
+              } while (top[i][j] == make_pair(i, j) || i + si >= N || j + sj >= N || top[i+si][j] == make_pair(i+si, j) || top[i][j+sj] == make_pair(i, j+sj) || (localTries > 0 && (abs(i - localI) > 20 || abs(j - localJ) > 20)));
+              // if (localTries > 0) localTries--;
+              StageAdd(i, j, -1);
+              StageAdd(i+si, j, -1);
+              StageAdd(i, j+sj, -1);
+              if (Settle(kMoveAdd)) {
+                setlocal
+              }
             }
-          }
 
-          { // REM
-            int id = rng() % (int) corners.size();
-            i = corners[id].first;
-            j = corners[id].second;
-            if (localTries > 0) {
-                localTries--;
-                if (abs(i - localI) > 40 || abs(j - localJ) > 40) {
-                    continue;
-                }
-            }
-            auto old_total = total;
-            RemoveCorner(i, j);
-            if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-              wlog("REM");
-              setlocal
-            } else {
-              AddCorner(i, j, id);
+            { // REM
+              int id = rng() % (int) corners.size();
+              i = corners[id].first;
+              j = corners[id].second;
+              if (localTries > 0) {
+                  localTries--;
+                  if (abs(i - localI) > 40 || abs(j - localJ) > 40) {
+                      continue;
+                  }
+              }
+              StageRemove(i, j);
+              if (Settle(kMoveRem)) {
+                setlocal
+              }
             }
           }
-        }
-    };
-
-    auto optimizeRegions = [&]() {
-        int R = 25;
-        int RS = N / R;
-        assert(N % R == 0);
-        vector<vector<double>> regionsWeight(R, vector<double>(R, 1));
-        for (int it = 0; it < 100000000; it++) {
-          if (total < best_total) {
-            best_total = total;
-            rects.clear();
-            rects.emplace_back(make_pair(0, 0), paint_into[0][0]);
-            for (auto& p : corners) {
-              rects.emplace_back(p, paint_into[p.first][p.second]);
-            }
+      };
+
+      auto optimizeRegions = [&]() {
+          int R = 25;
+          int RS = N / R;
+          assert(N % R == 0);
+          vector<vector<double>> ownWeight(R, vector<double>(R, 1));
+          if (resumed && (int) resumed->weights.size() == R * R) {
+            for (int k = 0; k < R * R; k++) ownWeight[k / R][k % R] = resumed->weights[k];
           }
-          if (GetTime() > optSeconds || !optRunning) {
-            break;
+          if (workers > 1) {
+            RegionSync([&] {
+              region_weights = ownWeight;
+              region_claimed.assign(N, vector<int>(N, -1));
+            });
           }
-
-          int ri = 0, rj = 0;
-          vector<int> cidsInRegion;
-          // double v = GetTime();
-          while (true) {
-              double tw = 0;
-              for (int i = 0; i < R; i++)
-                for (int j = 0; j < R; j++)
-                  tw += regionsWeight[i][j];
-
-              double coin = urd(rng) * tw;
-              ri = R - 1, rj = R - 1;
-              for (int i = 0; i < R; i++)
-                for (int j = 0; j < R; j++) {
-                  tw -= regionsWeight[i][j];
-                  if (tw < coin) {
-                    ri = i;
-                    rj = j;
-                    goto out;
+          auto& regionsWeight = workers > 1 ? region_weights : ownWeight;
+          auto CornersIn = [&](int ri, int rj) {
+            vector<int> ids;
+            for (int i = ri * RS; i < (ri + 1) * RS; i++)
+                for (int j = rj * RS; j < (rj + 1) * RS; j++)
+                    if ((i > 0 || j > 0) && top[i][j] == make_pair(i, j)) {
+                        ids.push_back(corners.position(make_pair(i, j)));
+                    }
+            sort(ids.begin(), ids.end());
+            return ids;
+          };
+          auto Reward = [&](int ri, int rj, bool impr) {
+            const double lambda = 0.8;
+            const double goodWeight = 50;
+            if (impr) {
+              regionsWeight[ri][rj] = goodWeight * lambda + (1 - lambda) * regionsWeight[ri][rj];
+              for (int di = -1; di <= 1; di++)
+                  for (int dj = -1; dj <= 1; dj++) {
+                      int nri = ri + di;
+                      int nrj = rj + dj;
+                      if (nri >= 0 && nri < R && nrj >= 0 && nrj < R)
+                          regionsWeight[nri][nrj] = goodWeight * lambda * lambda + (1 - lambda * lambda) * regionsWeight[ri][rj];
                   }
+            } else regionsWeight[ri][rj] = 1 * lambda + (1 - lambda) * regionsWeight[ri][rj];
+          };
+          // Hands out regions of checkerboard class it % 4, so no two are
+          // neighbours, drawn by weight among the ones with corners. Workers
+          // left without one get no region for the round.
+          auto PickRegions = [&](int it) {
+            region_stop = GetTime() > optSeconds || !optRunning;
+            if (region_stop) return;
+            vector<pair<int, int>> open;
+            for (int ri = it % 4 / 2; ri < R; ri += 2)
+              for (int rj = it % 2; rj < R; rj += 2)
+                open.emplace_back(ri, rj);
+            for (int w = 0; w < workers; w++) {
+              region_of[w] = make_pair(-1, -1);
+              while (!open.empty()) {
+                double tw = 0;
+                for (auto [ri, rj] : open) tw += regionsWeight[ri][rj];
+                double coin = uniform_real_distribution<double>(0, tw)(region_rng);
+                int k = 0;
+                while (k + 1 < (int) open.size() && (coin -= regionsWeight[open[k].first][open[k].second]) >= 0) k++;
+                auto region = open[k];
+                open.erase(open.begin() + k);
+                if (!CornersIn(region.first, region.second).empty()) {
+                  region_of[w] = region;
+                  break;
                 }
-              out:;
-
-            for (size_t id = 0; id < corners.size(); id++)
-                if (corners[id].first / RS == ri && corners[id].second / RS == rj) {
-                    cidsInRegion.push_back(id);
-                }
+              }
+            }
+          };
+          // Keeps the rounds, in worker order, that read no cell an earlier kept
+          // round read.
+          auto MergeRounds = [&]() {
+            map<pair<int, int>, int> rounds_of;
+            for (int w = 0; w < workers; w++) {
+              auto& round = region_rounds[w];
+              bool fits = true;
+              for (auto [i, j] : round.cells) fits &= region_claimed[i][j] != region_round;
+              region_kept[w] = fits;
+              if (region_of[w].first != -1) Reward(region_of[w].first, region_of[w].second, fits && round.impr);
+              if (!fits) continue;
+              for (auto [i, j] : round.cells) region_claimed[i][j] = region_round;
+              for (auto& [o, c, fill] : round.owners) rounds_of[o]++;
+            }
+            region_fixed.clear();
+            region_shared.clear();
+            for (int w = 0; w < workers; w++) {
+              if (!region_kept[w]) continue;
+              for (auto& [o, c, fill] : region_rounds[w].owners) {
+                if (rounds_of[o] == 1) region_fixed.emplace_back(o, c, fill);
+                else if (rounds_of[o] > 1) region_shared.push_back(o);
+                if (rounds_of[o] > 1) rounds_of[o] = 0;
+              }
+            }
+          };
+          // Brings this worker's copy to the merged state: undoes its own round
+          // if it was dropped, then applies the others' kept moves.
+          auto Replay = [&]() {
+            auto SetCost = [&](pair<int, int> o, int new_cost, Color fill) {
+              total += new_cost - cost[o.first][o.second];
+              cost[o.first][o.second] = new_cost;
+              paint_into[o.first][o.second] = fill;
+              if (owned[o.first][o.second].total == 0) owned[o.first][o.second] = Palette();
+            };
+            if (!region_kept[worker]) {
+              for (int k = (int) round_undo.size() - 1; k >= 0; k--) {
+                auto [c, pos] = round_undo[k];
+                if (pos == -1) StageRemove(c.first, c.second);
+                else StageAdd(c.first, c.second, pos);
+              }
+              Apply();
+              for (auto& [o, c, fill] : round_before) SetCost(o, c, fill);
+            }
+            for (int w = 0; w < workers; w++) {
+              if (w == worker || !region_kept[w]) continue;
+              for (auto& [c, after] : region_rounds[w].ops) {
+                Materialize(); // the position below is taken after the edits before
+                if (after.first == -1) StageRemove(c.first, c.second);
+                else StageAdd(c.first, c.second, after == make_pair(0, 0) ? 0 : corners.position(after) + 1);
+              }
+            }
+            Apply();
+            for (auto& [o, c, fill] : region_fixed) SetCost(o, c, fill);
+            for (auto o : region_shared) {
+              int new_cost = 0;
+              Color fill = paint_into[o.first][o.second];
+              if (owned[o.first][o.second].total > 0) {
+                double diff;
+                fill = bestFill(owned[o.first][o.second], &diff);
+                new_cost = base_cost[o.first][o.second] + llround(diff * 5);
+              }
+              SetCost(o, new_cost, fill);
+            }
+          };
+          for (int it = first_it; it < 100000000; it++) {
+            if (replica == 0 && workers == 1) temp = T;
+            if (total < best_total) {
+              best_total = total;
+              rects.clear();
+              rects.emplace_back(make_pair(0, 0), paint_into[0][0]);
+              for (auto& p : corners) {
+                rects.emplace_back(p, paint_into[p.first][p.second]);
+              }
+            }
+            tele.iterate(it, GetTime(), total, best_total, (int) corners.size());
+            if (replicas > 1 && GetTime() >= next_meet) {
+              if (snapshot_due) Snapshot(it, regionsWeight);
+              Meet(replica, total, temp, false);
+              next_meet += 1;
+            }
+            if (workers > 1) {
+              if (snapshot_due) Snapshot(it, regionsWeight);
+              RegionSync([&] {
+                SnapshotMeeting();
+                PickRegions(it);
+                region_T = T;
+              });
+              temp = region_T;
+              if (region_stop) {
+                if (snapshots) Snapshot(it, regionsWeight);
+                break;
+              }
+            } else {
+              Checkpoint(it, regionsWeight);
+              if (GetTime() > optSeconds || !optRunning) {
+                if (snapshots) Snapshot(it, regionsWeight);
+                break;
+              }
+            }
 
-            if (!cidsInRegion.empty()) break;
-          }
-          // cerr << "passed " << GetTime() - v << "s\n";
-
-          bool impr = false;
-          int it_start_total = total;
-
-          if (!corners.empty()) {
-            for (int id : cidsInRegion) {
-                int i = corners[id].first;
-                int j = corners[id].second;
-                int conts = 0;
-                while (true) {
-                  int ni = i - 3 + rng() % 7;
-                  int nj = j - 3 + rng() % 7;
-                  if (ni < 0 || nj < 0 || ni >= N || nj >= N || top[ni][nj] == make_pair(ni, nj) || (ni == 0 && nj == 0)) {
-                    if (++conts > 5) {
-                      break;
+            int ri = 0, rj = 0;
+            vector<int> cidsInRegion;
+            bool idle = false; // no region this round, submit it empty
+            // double v = GetTime();
+            if (workers > 1) {
+              region_rounds[worker] = RegionRound();
+              round_undo.clear();
+              round_before.clear();
+              sync_round++;
+              tie(ri, rj) = region_of[worker];
+              idle = ri == -1;
+              if (!idle) cidsInRegion = CornersIn(ri, rj);
+            } else while (true) {
+                double tw = 0;
+                for (int i = 0; i < R; i++)
+                  for (int j = 0; j < R; j++)
+                    tw += regionsWeight[i][j];
+
+                double coin = urd(rng) * tw;
+                ri = R - 1, rj = R - 1;
+                for (int i = 0; i < R; i++)
+                  for (int j = 0; j < R; j++) {
+                    tw -= regionsWeight[i][j];
+                    if (tw < coin) {
+                      ri = i;
+                      rj = j;
+                      goto out;
                     }
-                    continue;
                   }
-                  {
-                    int L = 0;
-                    int R = (int) corners.size();
-                    for (int it = 0; it < (int) corners.size(); it++) {
-                      if (corners[it].first <= ni && corners[it].second <= nj) {
-                        L = max(L, it + 1);
-                      }
-                      if (ni <= corners[it].first && nj <= corners[it].second) {
-                        R = min(R, it);
-                      }
-                    }
-                    if (L > id || id > R) {
+                out:;
+
+              cidsInRegion = CornersIn(ri, rj);
+              if (!cidsInRegion.empty()) break;
+            }
+            // cerr << "passed " << GetTime() - v << "s\n";
+
+            bool impr = false;
+            int it_start_total = total;
+
+            if (!corners.empty()) {
+              for (int id : cidsInRegion) {
+                  int i = corners[id].first;
+                  int j = corners[id].second;
+                  int conts = 0;
+                  while (true) {
+                    int ni = i - 3 + rng() % 7;
+                    int nj = j - 3 + rng() % 7;
+                    if (ni < 0 || nj < 0 || ni >= N || nj >= N || top[ni][nj] == make_pair(ni, nj) || (ni == 0 && nj == 0)) {
                       if (++conts > 5) {
                         break;
                       }
                       continue;
                     }
-                  }
-                  conts = 0;
-                  auto old_total = total;
-                  RemoveCorner(i, j);
-                  AddCorner(ni, nj, id);
-                  if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-                    wlog("MOV");
-                    impr |= total < it_start_total;
-                    i = ni;
-                    j = nj;
-                  } else {
-                    RemoveCorner(ni, nj);
-                    AddCorner(i, j, id);
-                    break;
-                  }
-                }
-            }
-          }
-          // cerr << "passed " << GetTime() - v << "s\n";
-
-          if (it % 3 == 0) { // SWP
-              if (corners.size() >= 2) {
-                for (int id : cidsInRegion) {
-                    int i = corners[id].first;
-                    int j = corners[id].second;
-                    auto old_total = total;
-                    RemoveCorner(i, j);
-                    AddCorner(i, j, -1);
-                    if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-                      wlog("SWP");
+                    {
+                      auto [L, R] = corners.window(make_pair(ni, nj));
+                      if (L > id || id > R) {
+                        if (++conts > 5) {
+                          break;
+                        }
+                        continue;
+                      }
+                    }
+                    conts = 0;
+                    StageRemove(i, j);
+                    StageAdd(ni, nj, id);
+                    if (Settle(kMoveMov)) {
                       impr |= total < it_start_total;
-                      break;
+                      i = ni;
+                      j = nj;
                     } else {
-                      RemoveCorner(i, j);
-                      AddCorner(i, j, id);
+                      break;
                     }
+                  }
+              }
+            }
+            // cerr << "passed " << GetTime() - v << "s\n";
+
+            if (it % 3 == 0) { // SWP
+                if (corners.size() >= 2) {
+                  for (int id : cidsInRegion) {
+                      int i = corners[id].first;
+                      int j = corners[id].second;
+                      StageRemove(i, j);
+                      StageAdd(i, j, -1);
+                      if (Settle(kMoveSwp)) {
+                        impr |= total < it_start_total;
+                        break;
+                      }
+                  }
                 }
+                // cerr << it % 3 << " op, passed " << GetTime() - v << "s\n";
+            } else if (it % 3 == 1) { // ADD
+              if (!idle)
+              for (int i = ri * RS; i < (ri + 1) * RS; i++)
+                  for (int j = rj * RS; j < (rj + 1) * RS; j++) {
+                      if (top[i][j] == make_pair(i, j)) continue;
+                      if (rng() % 17) continue;
+
+                      StageAdd(i, j, -1);
+                      if (Settle(kMoveAdd)) {
+                        impr |= total < it_start_total;
+                      }
+                  }
+              // cerr << it % 3 << " op, passed " << GetTime() - v << "s\n";
+            } else if (it > 123) { // REM
+              for (int id : cidsInRegion) {
+                  int i = corners[id].first;
+                  int j = corners[id].second;
+                  StageRemove(i, j);
+                  if (Settle(kMoveRem)) {
+                    impr |= total < it_start_total;
+                    break;
+                  }
               }
               // cerr << it % 3 << " op, passed " << GetTime() - v << "s\n";
-          } else if (it % 3 == 1) { // ADD
-            for (int i = ri * RS; i < (ri + 1) * RS; i++)
-                for (int j = rj * RS; j < (rj + 1) * RS; j++) {
-                    if (top[i][j] == make_pair(i, j)) continue;
-                    if (rng() % 17) continue;
-
-                    auto old_total = total;
-                    AddCorner(i, j, -1);
-                    if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-                      wlog("ADD");
-                      impr |= total < it_start_total;
-                    } else {
-                      RemoveCorner(i, j);
-                    }
-                }
-            // cerr << it % 3 << " op, passed " << GetTime() - v << "s\n";
-          } else if (it > 123) { // REM
-            for (int id : cidsInRegion) {
-                int i = corners[id].first;
-                int j = corners[id].second;
-                auto old_total = total;
-                RemoveCorner(i, j);
-                if (total <= old_total || exp((old_total - total) / 10000.0 / T) > urd(rng)) {
-                  wlog("REM");
-                  impr |= total < it_start_total;
-                  break;
-                } else {
-                  AddCorner(i, j, id);
-                }
             }
-            // cerr << it % 3 << " op, passed " << GetTime() - v << "s\n";
-          }
 
-          const double lambda = 0.8;
-          const double goodWeight = 50;
-          if (impr) {
-            regionsWeight[ri][rj] = goodWeight * lambda + (1 - lambda) * regionsWeight[ri][rj];
-            for (int di = -1; di <= 1; di++)
-                for (int dj = -1; dj <= 1; dj++) {
-                    int nri = ri + di;
-                    int nrj = rj + dj;
-                    if (nri >= 0 && nri < R && nrj >= 0 && nrj < R)
-                        regionsWeight[nri][nrj] = goodWeight * lambda * lambda + (1 - lambda * lambda) * regionsWeight[ri][rj];
-                }
-          } else regionsWeight[ri][rj] = 1 * lambda + (1 - lambda) * regionsWeight[ri][rj];
-          // cerr << "end, passed " << GetTime() - v << "s\n";
-          // msg << "[" << ri << ", " << rj << "] corners in region: " << cidsInRegion.size();
-        }
-    };
+            if (workers > 1) {
+              auto& round = region_rounds[worker];
+              round.impr = impr;
+              for (auto& [o, c, fill] : round_before) {
+                round.owners.emplace_back(o, cost[o.first][o.second], paint_into[o.first][o.second]);
+              }
+              RegionSync(MergeRounds);
+              Replay();
+            } else Reward(ri, rj, impr);
+            // cerr << "end, passed " << GetTime() - v << "s\n";
+            // msg << "[" << ri << ", " << rj << "] corners in region: " << cidsInRegion.size();
+          }
+      };
 
-    if (hardRects) {
-        while (true) {
-            if (GetTime() > optSeconds || !optRunning) {
-                break;
-            }
+      if (hard) {
+          while (true) {
+              if (GetTime() > optSeconds || !optRunning) {
+                  break;
+              }
 
-            int r1, c1, r2, c2;
-            while (true) {
-                r1 = rng() % N;
-                c1 = rng() % N;
-                r2 = rng() % N;
-                c2 = rng() % N;
-                if (c1 > c2) swap(c1, c2);
-                if (r1 > r2) swap(r1, r2);
-                if (r1 == r2 || c1 == c2) continue;
-                if (r2 - r1 < 40 || c2 - c1 < 40) continue;
-                if ((r2 - r1) * (c2 - c1) > 12345) continue;
-                if ((r2 - r1) * (c2 - c1) < 2555) continue;
+              int r1, c1, r2, c2;
+              while (true) {
+                  r1 = rng() % N;
+                  c1 = rng() % N;
+                  r2 = rng() % N;
+                  c2 = rng() % N;
+                  if (c1 > c2) swap(c1, c2);
+                  if (r1 > r2) swap(r1, r2);
+                  if (r1 == r2 || c1 == c2) continue;
+                  if (r2 - r1 < 40 || c2 - c1 < 40) continue;
+                  if ((r2 - r1) * (c2 - c1) > 12345) continue;
+                  if ((r2 - r1) * (c2 - c1) < 2555) continue;
 
-                break;
-            }
+                  break;
+              }
 
-            if (optimizeHard(r1, c1, r2, c2, hardIters))
-                break;
-        }
-    } else if (regionOpt)
-        optimizeRegions();
-    else
-        optimizeOneByOne();
+              if (optimizeHard(r1, c1, r2, c2, hardIters))
+                  break;
+          }
+      } else if (regions)
+          optimizeRegions();
+      else
+          optimizeOneByOne();
+      if (worker == 0) {
+        chain_best[replica] = best_total;
+        chain_rects[replica] = move(rects);
+      }
+      if (replicas > 1) Meet(replica, total, temp, true);
+    };
+    telemetry.start(replicas * workers, res.score);
+    parallelFor(replicas * workers, [&](int k) { RunChain(k / workers, k % workers); }, replicas * workers);
+    if (snapshots) SaveSnapshot();
+    int best = min_element(chain_best.begin(), chain_best.end()) - chain_best.begin();
+    auto& rects = chain_rects[best];
+    int best_total = chain_best[best];
+    if (replicas > 1) cerr << "best of " << replicas << " chains: " << best_total / 1000.0 << endl;
     drawR2 = drawC2 = 0;
 /*    sort(rects.begin(), rects.end(), [&](auto& r1, auto& r2) {
       return Priority(r1.first) < Priority(r2.first);
@@ -2334,32 +2895,33 @@ void solveOpt() {
       int ya = rects[i].first.second;
 //      cerr << "xa " << xa << " " << ya << endl;
       Color paint_into = rects[i].second;
+      BlockId cur = blockIds.root(idx);
       if (xa == 0 && ya == 0) {
-        res.ins.push_back(ColorIns(to_string(idx), paint_into));
+        res.ins.push_back(ColorIns(cur, paint_into));
       }
       if (xa == 0 && ya > 0) {
-        res.ins.push_back(SplitYIns(to_string(idx), ya));
-        res.ins.push_back(ColorIns(to_string(idx) + ".1", paint_into));
-        res.ins.push_back(MergeIns(to_string(idx) + ".0", to_string(idx) + ".1"));
+        res.ins.push_back(SplitYIns(cur, ya));
+        res.ins.push_back(ColorIns(blockIds.child(cur, 1), paint_into));
+        res.ins.push_back(MergeIns(blockIds.child(cur, 0), blockIds.child(cur, 1)));
         idx += 1;
       }
       if (xa > 0 && ya == 0) {
-        res.ins.push_back(SplitXIns(to_string(idx), xa));
-        res.ins.push_back(ColorIns(to_string(idx) + ".1", paint_into));
-        res.ins.push_back(MergeIns(to_string(idx) + ".0", to_string(idx) + ".1"));
+        res.ins.push_back(SplitXIns(cur, xa));
+        res.ins.push_back(ColorIns(blockIds.child(cur, 1), paint_into));
+        res.ins.push_back(MergeIns(blockIds.child(cur, 0), blockIds.child(cur, 1)));
         idx += 1;
       }
       if (xa > 0 && ya > 0) {
-        res.ins.push_back(SplitPointIns(to_string(idx), xa, ya));
-        res.ins.push_back(ColorIns(to_string(idx) + ".2", paint_into));
+        res.ins.push_back(SplitPointIns(cur, xa, ya));
+        res.ins.push_back(ColorIns(blockIds.child(cur, 2), paint_into));
         if (Compare(n - xa, n - ya)) {
-          res.ins.push_back(MergeIns(to_string(idx) + ".3", to_string(idx) + ".2"));
-          res.ins.push_back(MergeIns(to_string(idx) + ".0", to_string(idx) + ".1"));
+          res.ins.push_back(MergeIns(blockIds.child(cur, 3), blockIds.child(cur, 2)));
+          res.ins.push_back(MergeIns(blockIds.child(cur, 0), blockIds.child(cur, 1)));
         } else {
-          res.ins.push_back(MergeIns(to_string(idx) + ".3", to_string(idx) + ".0"));
-          res.ins.push_back(MergeIns(to_string(idx) + ".2", to_string(idx) + ".1"));
+          res.ins.push_back(MergeIns(blockIds.child(cur, 3), blockIds.child(cur, 0)));
+          res.ins.push_back(MergeIns(blockIds.child(cur, 2), blockIds.child(cur, 1)));
         }
-        res.ins.push_back(MergeIns(to_string(idx + 1), to_string(idx + 2)));
+        res.ins.push_back(MergeIns(blockIds.root(idx + 1), blockIds.root(idx + 2)));
         idx += 3;
       }
     }
@@ -2399,6 +2961,7 @@ void GetRekt() {
         }
         used.insert(make_pair(b.r1, b.c1));
     }
+    Palette palette;
     /*for (int i = 2; i < N; i++)
         for (int j = 2; j < N; j++)
             if (used.find(make_pair(i, j)) == used.end()) {
@@ -2418,18 +2981,10 @@ void GetRekt() {
     for (int i = RS; i < N; i += RS)
         for (int j = RS; j < N; j += RS)
             if (used.find(make_pair(i, j)) == used.end()) {
-                Color sum;
-                for (int q = 0; q < 4; q++) sum[q] = 0;
-                int total = 0;
-                for (int di = 0; di < RS; di++)
-                    for (int dj = 0; dj < RS; dj++)
-                        if (i + di < N && j + dj < N) {
-                            total++;
-                            for (int q = 0; q < 4; q++)
-                                sum[q] += colors[i+di][j+dj][q];
-                        }
-                Color c;
-                for (int q = 0; q < 4; q++) c[q] = sum[q] / total;
+                palette.clear();
+                for (int di = 0; di < RS && i + di < N; di++)
+                    palette.add(colors[i + di] + j, min(RS, N - j));
+                Color c = bestFill(palette);
 
                 coloredBlocks.push_back(Block{i, j, N, N, c});
                 int idx = coloredBlocks.size() - 1;
@@ -2441,9 +2996,7 @@ void GetRekt() {
 }
 
 void swapRects(int r1, int c1, int r2, int c2, int sr, int sc) {
-    for (int i = 0; i < sr; i++)
-        for (int j = 0; j < sc; j++)
-            swap(colors[r1+i][c1+j], colors[r2+i][c2+j]);
+    swapRect(colors, r1, c1, r2, c2, sr, sc);
 
     for (auto& b : coloredBlocks) {
         if (r1 <= b.r1 && b.r1 < r1 + sr && c1 <= b.c1 && b.c1 < c1 + sc) {
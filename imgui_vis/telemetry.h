@@ -0,0 +1,157 @@
+#pragma once
+
+#include "io.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Optimizer telemetry. Every solveOpt chain owns a channel: counters of tried
+// and kept moves per type, gauges of where it is, and a ring with its last
+// kRing moves. Only the owning thread writes a channel, with plain atomic
+// stores and no text, so the UI or an export can sample it at any moment
+// without locks. Events overwritten while being read are dropped.
+enum MoveType { kMoveSwp, kMoveMov, kMoveAdd, kMoveRem, kMoveTypes };
+
+inline const char* moveName(int type) {
+    static const char* names[kMoveTypes] = {"SWP", "MOV", "ADD", "REM"};
+    return names[type];
+}
+
+struct OptEvent {
+    uint64_t seq; // number of the move in its channel
+    int it;
+    int type;
+    bool kept;
+    int delta; // of the total, in thousandths of a point
+    int64_t total; // after the move
+    double time; // s since the run started
+};
+
+class Telemetry {
+  public:
+    static constexpr int kMaxChannels = 64;
+    static constexpr int kRing = 1 << 16;
+
+    class Channel {
+      public:
+        // Writer side, for the owning thread only.
+        void iterate(int it, double time, int64_t total, int64_t best, int corners) {
+            it_ = it;
+            ms_ = uint32_t(time * 1000);
+            store(iterations, it);
+            store(this->total, total);
+            store(this->best, best);
+            store(this->corners, corners);
+            store(this->ms, ms_);
+        }
+        void move(int type, bool kept, int delta, int64_t total) {
+            store(tries[type], tries[type].load(memory_order_relaxed) + 1);
+            if (kept) {
+                store(this->kept[type], this->kept[type].load(memory_order_relaxed) + 1);
+                store(this->total, total);
+            }
+            // claimed goes first, so a reader can tell the slot it read was
+            // being overwritten
+            uint64_t seq = events.load(memory_order_relaxed);
+            claimed.store(seq + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            auto& slot = ring[seq % kRing];
+            slot[0].store(uint32_t(it_) | uint64_t(type) << 32 | uint64_t(kept) << 40, memory_order_relaxed);
+            slot[1].store(uint32_t(delta) | uint64_t(ms_) << 32, memory_order_relaxed);
+            slot[2].store(total, memory_order_relaxed);
+            events.store(seq + 1, memory_order_release);
+        }
+
+        atomic<uint64_t> tries[kMoveTypes], kept[kMoveTypes];
+        atomic<int64_t> iterations, total, best, corners, ms;
+        atomic<uint64_t> events, claimed;
+
+      private:
+        friend class Telemetry;
+        template <class A, class V>
+        static void store(A& a, V v) { a.store(v, memory_order_relaxed); }
+
+        void reset() {
+            for (int t = 0; t < kMoveTypes; t++) {
+                tries[t] = 0;
+                kept[t] = 0;
+            }
+            iterations = total = best = corners = ms = 0;
+            claimed = events = 0;
+            it_ = 0;
+            ms_ = 0;
+        }
+
+        array<atomic<uint64_t>, 3> ring[kRing];
+        int it_ = 0;
+        uint32_t ms_ = 0;
+    };
+
+    // Starts a run with n channels; score is what totals are added to.
+    void start(int n, int64_t score) {
+        for (int c = 0; c < n; c++) {
+            if (!channel_[c].load(memory_order_acquire)) {
+                auto* ch = new Channel(); // kept for the next runs
+                ch->reset();
+                channel_[c].store(ch, memory_order_release);
+            } else {
+                channel_[c].load(memory_order_relaxed)->reset();
+            }
+        }
+        base_.store(score, memory_order_relaxed);
+        channels_.store(n, memory_order_release);
+    }
+
+    int channels() const { return channels_.load(memory_order_acquire); }
+    int64_t base() const { return base_.load(memory_order_relaxed); }
+    Channel& channel(int c) { return *channel_[c].load(memory_order_acquire); }
+    const Channel& channel(int c) const { return *channel_[c].load(memory_order_acquire); }
+
+    // The events of channel c numbered `from` and on, at most the last kRing,
+    // oldest first.
+    vector<OptEvent> events(int c, uint64_t from = 0) const {
+        const auto& ch = channel(c);
+        uint64_t end = ch.events.load(memory_order_acquire);
+        uint64_t begin = max(from, end > kRing ? end - kRing : 0);
+        // a restart can reset the channel after the caller read its count
+        if (begin >= end) return {};
+        vector<array<uint64_t, 3>> raw;
+        raw.reserve(end - begin);
+        for (uint64_t seq = begin; seq < end; seq++) {
+            auto& slot = ch.ring[seq % kRing];
+            raw.push_back({slot[0].load(memory_order_relaxed), slot[1].load(memory_order_relaxed),
+                           slot[2].load(memory_order_relaxed)});
+        }
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t claimed = ch.claimed.load(memory_order_relaxed);
+        vector<OptEvent> res;
+        for (uint64_t seq = begin; seq < end; seq++) {
+            if (seq + kRing < claimed) continue;
+            auto& w = raw[seq - begin];
+            res.push_back(OptEvent{seq, int(uint32_t(w[0])), int(w[0] >> 32 & 255), bool(w[0] >> 40 & 1),
+                                   int(uint32_t(w[1])), int64_t(w[2]), (w[1] >> 32) * 0.001});
+        }
+        return res;
+    }
+
+    // All channels' events as CSV, one row per move, with delta and total in
+    // points like the score.
+    bool writeCsv(const string& fname) const {
+        return writeAtomically(fname, [&](ostream& out) {
+            out << "channel,seq,it,type,kept,delta,total,time\n";
+            for (int c = 0; c < channels(); c++)
+                for (const auto& e : events(c))
+                    out << c << ',' << e.seq << ',' << e.it << ',' << moveName(e.type) << ',' << e.kept << ','
+                        << e.delta / 1000.0 << ',' << base() + e.total / 1000.0 << ',' << e.time << '\n';
+        });
+    }
+
+  private:
+    atomic<Channel*> channel_[kMaxChannels] = {};
+    atomic<int> channels_{0};
+    atomic<int64_t> base_{0};
+};
+
+Telemetry telemetry;